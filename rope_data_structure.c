@@ -3,19 +3,26 @@
 
 //#define DEBUG
 
+/* Optional augmentations. They cost time in every rotation and memory in every node, so they are off by default. */
+//#define ROPE_HASH                                             // substring hashes, for O(log^2 n) longestCommonPrefix()
+//#define ROPE_LAYOUT                                           // display columns, for columnOf() and offsetAtColumn()
+
 /* *** Rope Data Structure *** */
 
 /* Implementation of a data structure that can store a string and efficiently cut a part
  * (a substring) of this string and insert it in a different position.
- * This implementation only processes a given string.
- * It doesn't support insertion of new characters in the string. */
+ * Besides cutting and pasting, the string can be edited: insert() adds a character at any rank,
+ * splice() replaces a range with a new string, erase() deletes a range, and applyEdits() applies a batch of edits. */
 
 /* https://en.wikipedia.org/wiki/Rope_(data_structure) */
 
 /* Uses Splay tree to implement the Rope data structure */
 
 /* Nodes don't have keys. They only have values. And the value is a character.
- * That means that one node contains and represents a single character.
+ * That means that one node contains and represents a single character, or a run of equal characters, so that
+ * long runs (padding, whitespace) take a single node. A run is cut in two when a split falls inside it.
+ * A node also carries an attribute (a style, or any other metadata of the characters), so attributes move together
+ * with the characters, and the characters of a run share it.
  * This data structure is about strings. The string represents (is) contents of a text document.
  * In a string, characters are in order, of course. The order is represented by their rank. That's why we use
  * order statistics to locate a node when searching for it (performing a "find" operation).
@@ -30,60 +37,556 @@
  * Copyright (c) 2017 Ivan Lazarevic */
 
 #define _CRT_SECURE_NO_WARNINGS
+#define _DEFAULT_SOURCE                                         // madvise() and the other POSIX extensions, also under -std=c11
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define ROPE_POSIX
+#endif
+
+#ifdef ROPE_POSIX
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // ROPE_POSIX
+
+#ifdef __linux__
+#define ROPE_SERVER
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif // __linux__
+
 #define S_MAX_LEN 300001                                        // + 1 for '\0'
 #define TRUE 1
 #define FALSE 0
+#define LEFT 0
+#define RIGHT 1
+#define HASH_MOD 0x1FFFFFFFFFFFFFFFULL                          // 2^61 - 1
+#define HASH_BASE 0x1A2B3C4D5E6F7ULL
 
 typedef struct Node Node;
 
+#ifdef ROPE_LAYOUT
+
+typedef struct Layout Layout;
+
+/* Layout "class": the effect of a piece of text on the column of a cursor, see _composeLayout(). */
+struct Layout {
+    unsigned newlines;
+    unsigned advance, stop;                                     // the head moves column c to c + advance if stop == 0,
+                                                                // or else to (c + advance) / tab width * tab width + stop
+    unsigned tail;                                              // the column at the end, if there are newlines
+};
+
+#endif // ROPE_LAYOUT
+
 /* Node "class" */
 struct Node {
     char value;
-    Node *parent, *left, *right;
-    unsigned size;
+    char styled;                                                // boolean; TRUE if some node of the subtree has an attribute
+    char anchored;                                              // boolean; TRUE if some node of the subtree has anchors
+    unsigned char hasAnchors : 1;                               // boolean; TRUE if anchors point to the node
+    unsigned char packed : 1;                                   // boolean; TRUE if the node is a compressed segment
+    unsigned attribute;                                         // attribute of the node's run; 0 means none
+    Node *parent, *child[2];                                    // child[LEFT] and child[RIGHT]
+    unsigned size;                                              // number of characters in the subtree
+    unsigned count;                                             // number of characters in the node's run
+#ifdef ROPE_HASH
+    unsigned long long hash;                                    // polynomial hash of the substring of the subtree
+    unsigned long long power;                                   // HASH_BASE ^ size
+#endif // ROPE_HASH
+#ifdef ROPE_LAYOUT
+    Layout layout;                                              // layout of the substring of the subtree
+#endif // ROPE_LAYOUT
 };
 
 /* "constructor" for the Node "class" */
 static inline Node *createNode(char value);
 
 typedef struct SplayTree SplayTree;
+typedef struct Anchor Anchor;
+typedef struct EditEvent EditEvent;
+
+/* Observer callback, see setObserver(). */
+typedef void (*EditObserver)(void *context, const EditEvent *event);
 
 /* SplayTree "class" */
 struct SplayTree {
     Node *root;
     unsigned size;
+    unsigned long lastAccess;                                   // epoch of the last access, see advanceEpoch()
+    Anchor *anchors;                                            // anchors at the end of the string; the others are in anchorTable
+    EditObserver observer;                                      // called after every edit; NULL if none
+    void *observerContext;
+    unsigned editedFrom;                                        // lowest rank changed since it was reset, see checkpointStep()
+};
+
+#define EDIT_MOVE 0                                             // text was moved; oldLength == newLength
+#define EDIT_REPLACE 1                                          // text was replaced; insertions and deletions have an empty range
+
+/* EditEvent "class"
+ * Describes one edit: the range S[oldStart..oldStart+oldLength-1] of the string before the edit became
+ * the range S[newStart..newStart+newLength-1] of the string after it. The rest of the string didn't change,
+ * except for being shifted. When one operation produces several events, each one applies to the string
+ * left by the previous one. */
+struct EditEvent {
+    int kind;
+    unsigned oldStart, oldLength;
+    unsigned newStart, newLength;
+};
+
+/* Anchor "class"
+ * A stable position in the string. It's attached to the node of a character, so it moves together with
+ * the character when process() and the other operations rearrange the string. */
+struct Anchor {
+    Node *node;                                                 // NULL means the end of the string
+    Anchor *prev, *next;                                        // neighbours in the bucket of the node, or in the tree's list
 };
 
+/* Global access epoch. Trees remember the epoch in which they were last accessed,
+ * so that the ones which haven't been touched for a while can be compressed. */
+static unsigned long ropeEpoch = 0;
+
 /* "constructor" for the SplayTree "class"
  * Creates an empty splay tree. */
 static inline SplayTree *createTree(void);
 
 /* "destructor" for the SplayTree "class"
- * Destroys all individual nodes in a tree, and then the tree itself. */
+ * Destroys all individual nodes in a tree, its anchors, and then the tree itself. */
 static void destroyTree(SplayTree *tree);
 
+/* Marks the tree as accessed, see compressIfCold(). */
+static inline void _touch(SplayTree *tree);
+
+/* Copies the substring of len characters starting at rank i into out. */
+static void substring(SplayTree *tree, unsigned i, unsigned len, char *out);
+
+/* Destroys the anchors of the node. */
+static void _dropAnchors(Node *node);
+
+/* Frees an anchor which isn't linked anywhere anymore. */
+static void _releaseAnchor(Anchor *anchor);
+
+/* Frees the compressed text of a packed node. */
+static void _dropSegment(Node *node);
+
+/* Decompresses the text of a packed node into out, which must have room for node->count characters. */
+static void _segmentText(const Node *node, char *out);
+
+/* Builds a tree out of pieces[lo..hi], using separators[lo..hi-1] as the nodes between them, and returns its root. */
+static Node *_concatPieces(Node **pieces, Node **separators, unsigned lo, unsigned hi);
+
+/* *** Node allocator *** */
+
+/* Nodes are allocated from slabs of NODE_SLAB_SIZE bytes, which are aligned to their size, so the slab of a node
+ * is found by masking its address. Every slab has its own free list and counts its nodes in use, and the slabs
+ * with free room are kept in a list, from which new nodes are taken.
+ * When all nodes of a slab are freed, the slab is kept for reuse only while there are at most nodeRetention
+ * empty slabs; the others are returned to the OS with munmap() at once. So a long-running process doesn't hold on to
+ * its peak memory after large trees are destroyed or shrunk, which malloc() and free() of single nodes can't promise,
+ * because a few live nodes are enough to pin a whole region of the heap.
+ * Without mmap(), slabs are carved out of malloc() blocks of twice their size, which are returned with free().
+ * The allocator isn't synchronized; nodes are only created and freed by one thread at a time. */
+
+#define NODE_SLAB_SIZE (64 * 1024)
+#define NODE_RETENTION 16                                       // default number of empty slabs kept for reuse
+
+typedef struct NodeSlab NodeSlab;
+
+/* NodeSlab "class": the header at the start of every slab, followed by the nodes. */
+struct NodeSlab {
+    NodeSlab *prev, *next;                                      // neighbours in the list of slabs with free room
+    Node *freeList;                                             // freed nodes, linked through their parent pointers
+    unsigned used;                                              // nodes in use
+    unsigned fresh;                                             // nodes handed out at least once; the rest were never touched
+    void *block;                                                // the allocation which contains the slab
+};
+
+#define NODES_PER_SLAB ((unsigned)((NODE_SLAB_SIZE - sizeof(NodeSlab)) / sizeof(Node)))
+
+static NodeSlab *nodeSlabs = NULL, *lastSlab = NULL;            // slabs with free room; partly used ones first
+static unsigned emptySlabs = 0, nodeRetention = NODE_RETENTION;
+static size_t slabCount = 0;
+
+static inline void _unlinkSlab(NodeSlab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else if (nodeSlabs == slab)
+        nodeSlabs = slab->next;
+    else
+        return;                                                 // not in the list
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    else
+        lastSlab = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+/* Puts the slab at the head of the list if atHead is TRUE, and at its tail otherwise. O(1) either way. */
+static void _linkSlab(NodeSlab *slab, int atHead) {
+    if (atHead || !nodeSlabs) {
+        slab->prev = NULL;
+        slab->next = nodeSlabs;
+        if (nodeSlabs)
+            nodeSlabs->prev = slab;
+        else
+            lastSlab = slab;
+        nodeSlabs = slab;
+        return;
+    }
+    lastSlab->next = slab;
+    slab->prev = lastSlab;
+    slab->next = NULL;
+    lastSlab = slab;
+}
+
+static NodeSlab *_newSlab(void) {
+    char *block, *aligned;
+#ifdef ROPE_POSIX
+    block = mmap(NULL, 2 * NODE_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        printf("Out of memory\n");
+        exit(-1);
+    }
+    aligned = (char *)(((uintptr_t)block + NODE_SLAB_SIZE - 1) & ~(uintptr_t)(NODE_SLAB_SIZE - 1));
+    if (aligned > block)
+        munmap(block, aligned - block);                         // trims the mapping to the aligned slab
+    munmap(aligned + NODE_SLAB_SIZE, block + NODE_SLAB_SIZE - aligned);
+    block = aligned;
+#else
+    block = malloc(2 * NODE_SLAB_SIZE);
+    aligned = (char *)(((uintptr_t)block + NODE_SLAB_SIZE - 1) & ~(uintptr_t)(NODE_SLAB_SIZE - 1));
+#endif // ROPE_POSIX
+    NodeSlab *slab = (NodeSlab *)aligned;
+    slab->freeList = NULL;
+    slab->used = 0;
+    slab->fresh = 0;
+    slab->block = block;
+    slabCount++;
+    emptySlabs++;
+    return slab;
+}
+
+static void _releaseSlab(NodeSlab *slab) {
+    _unlinkSlab(slab);
+    slabCount--;
+    emptySlabs--;
+#ifdef ROPE_POSIX
+    munmap(slab->block, NODE_SLAB_SIZE);
+#else
+    free(slab->block);
+#endif // ROPE_POSIX
+}
+
+/* Returns an uninitialized node. */
+static inline Node *_allocNode(void) {
+    NodeSlab *slab = nodeSlabs;
+    Node *node;
+    if (!slab) {
+        slab = _newSlab();
+        _linkSlab(slab, TRUE);
+    }
+    if (slab->freeList) {
+        node = slab->freeList;
+        slab->freeList = node->parent;
+    }
+    else
+        node = (Node *)(slab + 1) + slab->fresh++;
+    if (!slab->used++)
+        emptySlabs--;
+    if (!slab->freeList && slab->fresh == NODES_PER_SLAB)       // the slab is full
+        _unlinkSlab(slab);
+    return node;
+}
+
+/* "destructor" for the Node "class"
+ * Returns the node to its slab. If that empties the slab, the slab is kept for reuse, or given back to the OS
+ * if there are already nodeRetention empty slabs. */
+static inline void destroyNode(Node *node) {
+    NodeSlab *slab = (NodeSlab *)((uintptr_t)node & ~(uintptr_t)(NODE_SLAB_SIZE - 1));
+    if (!slab->freeList && slab->fresh == NODES_PER_SLAB)       // it was full, so it wasn't in the list
+        _linkSlab(slab, TRUE);
+    node->parent = slab->freeList;
+    slab->freeList = node;
+    if (--slab->used)
+        return;
+    emptySlabs++;
+    if (emptySlabs > nodeRetention) {
+        _releaseSlab(slab);
+        return;
+    }
+    slab->freeList = NULL;                                      // starts over, so that it's filled from the beginning
+    slab->fresh = 0;
+    _unlinkSlab(slab);
+    _linkSlab(slab, FALSE);                                     // partly used slabs are filled first
+}
+
+/* Sets the number of empty slabs that are kept for reuse instead of being returned to the OS,
+ * and returns the surplus ones right away. With 0, memory is returned as soon as possible. */
+static void setNodeRetention(unsigned slabs) {
+    nodeRetention = slabs;
+    NodeSlab *slab = nodeSlabs;
+    while (slab && emptySlabs > nodeRetention) {
+        NodeSlab *next = slab->next;
+        if (!slab->used)
+            _releaseSlab(slab);
+        slab = next;
+    }
+}
+
+/* Returns the memory held by the node allocator, in bytes. */
+static size_t nodeMemory(void) {
+    return slabCount * NODE_SLAB_SIZE;
+}
+
+#ifdef ROPE_LAYOUT
+
+/* *** Layout *** */
+
+/* Every node also knows the layout of its subtree: how the text moves the column of a cursor that runs over it.
+ * Characters advance the column by their display width, given by a width function; '\t' moves it to the next
+ * tab stop, and '\n' starts a new line at column 0. Because of the tab stops, the widths can't simply be summed up,
+ * but the effect of a piece of text without newlines on the column c always has one of two forms:
+ * c + advance, or (c + advance) / tabWidth * tabWidth + stop (if the text contains a tab), and two such effects
+ * compose into one of the same forms. A piece with newlines is described by the effect of its part before the first
+ * newline (its head), and by the column at its end, which doesn't depend on anything before the last newline.
+ * So layouts are combined in O(1) in _update(), just like sizes, and the column of an offset, or the offset at
+ * a column of a line, are found in O(log n) by descending the tree.
+ * The width function and the tab width are global, because layouts are cached in the nodes; they have to be set
+ * with setLayout() before any tree is built. The widths of all 256 characters are looked up in a table.
+ * Only compiled with ROPE_LAYOUT, because keeping the layouts up to date costs every rotation. */
+
+#define TAB_WIDTH 8
+
+typedef unsigned (*WidthFunction)(unsigned char c);
+
+/* Default width function. UTF-8 continuation bytes have no width, so a code point is one column. */
+static unsigned _defaultWidth(unsigned char c) {
+    return (c & 0xC0) != 0x80;
+}
+
+static unsigned ropeWidths[256];                                // the width of every character; filled in on first use
+static char ropeWidthsReady = FALSE;
+static unsigned ropeTabWidth = TAB_WIDTH;
+
+/* Sets the width function (NULL restores the default one) and the tab width (0 restores the default one) of all trees.
+ * Has to be called before any tree is built. */
+static void setLayout(WidthFunction width, unsigned tabWidth) {
+    if (!width)
+        width = _defaultWidth;
+    for (unsigned c = 0; c < 256; c++)
+        ropeWidths[c] = width((unsigned char)c);
+    ropeWidthsReady = TRUE;
+    ropeTabWidth = tabWidth ? tabWidth : TAB_WIDTH;
+}
+
+/* Returns the column after the head of the layout, if it starts at column c. */
+static inline unsigned _headColumn(const Layout *layout, unsigned c) {
+    if (!layout->stop)
+        return c + layout->advance;
+    return (c + layout->advance) / ropeTabWidth * ropeTabWidth + layout->stop;
+}
+
+/* Returns the column at the end of the text of the layout, if it starts at column 0. */
+static inline unsigned _endColumn(const Layout *layout) {
+    return layout->newlines ? layout->tail : _headColumn(layout, 0);
+}
+
+/* Computes the layout of the text of layout a followed by the text of layout b. result may be a or b. */
+static inline void _composeLayout(Layout *result, const Layout *a, const Layout *b) {
+    Layout out;
+    out.newlines = a->newlines + b->newlines;
+    out.advance = a->advance;
+    out.stop = a->stop;
+    if (!a->newlines) {                                         // b's head continues a's
+        if (!a->stop) {
+            out.advance = a->advance + b->advance;
+            out.stop = b->stop;
+        }
+        else if (!b->stop)
+            out.stop = a->stop + b->advance;
+        else
+            out.stop = (a->stop + b->advance) / ropeTabWidth * ropeTabWidth + b->stop;
+    }
+    if (b->newlines)
+        out.tail = b->tail;
+    else
+        out.tail = a->newlines ? _headColumn(b, a->tail) : 0;
+    *result = out;
+}
+
+/* Computes the layout of count copies of the character c. */
+static inline void _runLayout(Layout *layout, unsigned char c, unsigned count) {
+    layout->newlines = 0;
+    layout->advance = 0;
+    layout->stop = 0;
+    layout->tail = 0;
+    if (c == '\n')
+        layout->newlines = count;
+    else if (c == '\t')
+        layout->stop = count * ropeTabWidth;
+    else
+        layout->advance = count * ropeWidths[c];
+}
+
+#endif // ROPE_LAYOUT
+
 static inline Node *createNode(char value) {
-    Node *node = malloc(sizeof(Node));
+    Node *node = _allocNode();
+#ifdef ROPE_LAYOUT
+    if (!ropeWidthsReady)
+        setLayout(NULL, 0);
+#endif // ROPE_LAYOUT
     node->value = value;
+    node->styled = FALSE;
+    node->hasAnchors = FALSE;
+    node->anchored = FALSE;
+    node->packed = FALSE;
+    node->attribute = 0;
     node->parent = NULL;
-    node->left = NULL;
-    node->right = NULL;
+    node->child[LEFT] = NULL;
+    node->child[RIGHT] = NULL;
     node->size = 1;
+    node->count = 1;
+#ifdef ROPE_HASH
+    node->hash = (unsigned char)value;
+    node->power = HASH_BASE;
+#endif // ROPE_HASH
+#ifdef ROPE_LAYOUT
+    _runLayout(&node->layout, (unsigned char)value, 1);
+#endif // ROPE_LAYOUT
     return node;
 }
 
+#ifdef ROPE_HASH
+
+/* Polynomial hashing modulo the Mersenne prime 2^61 - 1.
+ * The hash of a string c[0..m-1] is c[0] * B^(m-1) + c[1] * B^(m-2) + ... + c[m-1], where B is HASH_BASE.
+ * Only compiled with ROPE_HASH, which makes every node keep the hash of its subtree. */
+
+static inline unsigned long long _modHash(unsigned long long x) {
+    x = (x >> 61) + (x & HASH_MOD);
+    return x >= HASH_MOD ? x - HASH_MOD : x;
+}
+
+/* Returns a * b mod 2^61 - 1, for a, b < 2^61 - 1, without 128-bit arithmetic. */
+static inline unsigned long long _mulHash(unsigned long long a, unsigned long long b) {
+    unsigned long long au = a >> 31, ad = a & 0x7FFFFFFFULL;
+    unsigned long long bu = b >> 31, bd = b & 0x7FFFFFFFULL;
+    unsigned long long mid = ad * bu + au * bd;
+    return _modHash((au * bu << 1) + (mid >> 30) + ((mid & 0x3FFFFFFFULL) << 31) + ad * bd);
+}
+
+/* Returns HASH_BASE ^ e mod 2^61 - 1. */
+static unsigned long long _powHash(unsigned e) {
+    unsigned long long result = 1, base = HASH_BASE;
+    for (; e; e >>= 1) {
+        if (e & 1)
+            result = _mulHash(result, base);
+        base = _mulHash(base, base);
+    }
+    return result;
+}
+
+/* Computes the hash of count copies of the character c, and HASH_BASE ^ count.
+ * The hash is c * (1 + B + ... + B^(count-1)); the sum and the power are doubled bit by bit, so it's O(log count). */
+static void _runHash(unsigned char c, unsigned count, unsigned long long *hash, unsigned long long *power) {
+    unsigned long long sum = 0, p = 1;                          // sum and power for the prefix of count's bits
+    int bit = 31;
+    if (count == 1) {
+        *hash = c;
+        *power = HASH_BASE;
+        return;
+    }
+    while (!(count >> bit))
+        bit--;
+    for (; bit >= 0; bit--) {
+        sum = _modHash(sum + _mulHash(sum, p));                 // doubling: sum(2m) = sum(m) * (1 + B^m)
+        p = _mulHash(p, p);
+        if (count >> bit & 1) {
+            sum = _modHash(_mulHash(sum, HASH_BASE) + 1);       // sum(m + 1) = sum(m) * B + 1
+            p = _mulHash(p, HASH_BASE);
+        }
+    }
+    *hash = _mulHash(sum, c);
+    *power = p;
+}
+
+#endif // ROPE_HASH
+
+/* Recomputes the size, the hash and the layout of the node from its children and its run.
+ * Has to be called on every node whose children or run change, bottom-up. */
+static inline void _update(Node *node) {
+    Node *left = node->child[LEFT], *right = node->child[RIGHT];
+#ifdef ROPE_HASH
+    unsigned long long hash = left ? left->hash : 0, power = left ? left->power : 1;
+    if (node->count == 1) {
+        hash = _modHash(_mulHash(hash, HASH_BASE) + (unsigned char)node->value);
+        power = _mulHash(power, HASH_BASE);
+    }
+    else {
+        unsigned long long runHash, runPower;
+        _runHash((unsigned char)node->value, node->count, &runHash, &runPower);
+        hash = _modHash(_mulHash(hash, runPower) + runHash);
+        power = _mulHash(power, runPower);
+    }
+    if (right) {
+        hash = _modHash(_mulHash(hash, right->power) + right->hash);
+        power = _mulHash(power, right->power);
+    }
+    node->hash = hash;
+    node->power = power;
+#endif // ROPE_HASH
+    node->size = (left ? left->size : 0) + (right ? right->size : 0) + node->count;
+    node->styled = node->attribute || (left && left->styled) || (right && right->styled);
+    node->anchored = node->hasAnchors || (left && left->anchored) || (right && right->anchored);
+#ifdef ROPE_LAYOUT
+    _runLayout(&node->layout, (unsigned char)node->value, node->count);
+    if (left)
+        _composeLayout(&node->layout, &left->layout, &node->layout);
+    if (right)
+        _composeLayout(&node->layout, &node->layout, &right->layout);
+#endif // ROPE_LAYOUT
+}
+
 static inline SplayTree *createTree(void) {
     SplayTree *tree = malloc(sizeof(SplayTree));
     tree->root = NULL;
     tree->size = 0;
+    tree->lastAccess = ropeEpoch;
+    tree->anchors = NULL;
+    tree->observer = NULL;
+    tree->observerContext = NULL;
+    tree->editedFrom = (unsigned)-1;
     return tree;
 }
 
+/* Registers the observer of the tree, which is called with the context after every process(), insert(), splice(),
+ * and the other editing operations, so that incremental consumers can update only the affected ranges.
+ * Pass NULL to remove it. */
+static void setObserver(SplayTree *tree, EditObserver observer, void *context) {
+    tree->observer = observer;
+    tree->observerContext = context;
+}
+
+static inline void _notify(SplayTree *tree, int kind, unsigned oldStart, unsigned oldLength, unsigned newStart, unsigned newLength) {
+    unsigned from = oldStart < newStart ? oldStart : newStart;  // the text before it didn't change
+    if (from < tree->editedFrom)
+        tree->editedFrom = from;
+    if (!tree->observer)
+        return;
+    EditEvent event = { kind, oldStart, oldLength, newStart, newLength };
+    tree->observer(tree->observerContext, &event);
+}
+
 /* We need post-order binary tree traversal to free all nodes.
  * Input is a pointer to a tree.
  * This is a usual post-order binary tree traversal in which visit() conducts freeing a node.
@@ -100,24 +603,28 @@ static void postOrderFree(SplayTree *tree) {
     while (current) {
         stack[size++] = current;
         boolStack[boolSize++] = 0;                              // false
-        current = current->left;
+        current = current->child[LEFT];
     }
     while (size) {
         current = stack[size - 1];
         alreadyEncountered = boolStack[boolSize - 1];
         if (alreadyEncountered) {
-            free(current);                                      // visit()
+            if (current->hasAnchors)
+                _dropAnchors(current);
+            if (current->packed)
+                _dropSegment(current);
+            destroyNode(current);                               // visit()
             size--;
             boolSize--;
         }
         else {
             boolSize--;
             boolStack[boolSize++] = 1;                          // true
-            current = current->right;
+            current = current->child[RIGHT];
             while (current) {
                 stack[size++] = current;
                 boolStack[boolSize++] = 0;                      // false
-                current = current->left;
+                current = current->child[LEFT];
             }
         }
     }
@@ -130,7 +637,12 @@ static void postOrderFree(SplayTree *tree) {
 static void destroyTree(SplayTree *tree) {
     if (!tree)
         return;
-    else if (!tree->root) {
+    while (tree->anchors) {
+        Anchor *next = tree->anchors->next;
+        _releaseAnchor(tree->anchors);
+        tree->anchors = next;
+    }
+    if (!tree->root) {
         free(tree);
         return;
     }
@@ -138,334 +650,4430 @@ static void destroyTree(SplayTree *tree) {
     free(tree);
 }
 
-/* Iterative in-order traversal.
- * Takes a tree* as input, and returns a string (a pointer to char).
- * It's faster to return (copy) one pointer than the whole string.
- * It could print nodes directly as it traverses the tree (and return void),
- * but that would mean calling putchar() or printf("%c") a large number of times,
- * instead of "appending" to the array result. */
-static char *inOrder(SplayTree *tree) {
+/* Iterative in-order traversal, which writes the characters into the given array.
+ * Input: pointer to a tree; array result of at least tree->size characters.
+ * Doesn't add the terminating '\0', and doesn't splay any node. Packed segments are decompressed straight into the array. */
+static void _inOrderInto(SplayTree *tree, char *result) {
     Node *current = tree->root;
-    /* static, because we want to initialize it with zeros (it'll contain a string), and because we need it outside of this function, in main().
-    This is faster than: char *result = calloc(tree->size + 1, sizeof(*result)); */
-    static char result[S_MAX_LEN];
     unsigned index = 0;
     if (!current)
-        return result;
+        return;
     Node **stack = malloc(tree->size * sizeof(*stack));
     size_t stackIndex = 0;
     while (TRUE) {
         while (current) {
             stack[stackIndex++] = current;
-            current = current->left;
+            current = current->child[LEFT];
         }
         if (stackIndex) {
             current = stack[--stackIndex];
-            result[index++] = current->value;                   // visit()
-            current = current->right;
+            if (current->packed)                                // visit()
+                _segmentText(current, result + index);
+            else
+                memset(result + index, current->value, current->count);
+            index += current->count;
+            current = current->child[RIGHT];
         }
         else
             break;
     }
     free(stack);
+}
+
+/* Iterative in-order traversal.
+ * Takes a tree* as input, and returns a string (a pointer to char).
+ * It's faster to return (copy) one pointer than the whole string.
+ * It could print nodes directly as it traverses the tree (and return void),
+ * but that would mean calling putchar() or printf("%c") a large number of times,
+ * instead of "appending" to the array result. */
+static char *inOrder(SplayTree *tree) {
+    /* static, because we want to initialize it with zeros (it'll contain a string), and because we need it outside of this function, in main().
+    This is faster than: char *result = calloc(tree->size + 1, sizeof(*result)); */
+    static char result[S_MAX_LEN];
+    _touch(tree);
+    _inOrderInto(tree, result);
     return result;
 }
 
-/* Input: Pointer to a tree, and a pointer to its node object that we want to rotate right.
- * Returns nothing.
- * Doesn't splay any node. */
-static void _rotateRight(SplayTree *tree, Node *node) {
-    Node *parent = node->parent;
-    Node *Y = node->left;
-    if (!Y)
-        return;                                                 // we can't rotate the node with nothing!
-    Node *B = Y->right;
-    Y->parent = parent;
-    if (parent) {
-        if (node == parent->left)                               // node is left child
-            parent->left = Y;
-        else                                                    // node is right child
-            parent->right = Y;
+/* *** Compression of cold segments *** */
+
+/* Trees that haven't been accessed for a number of epochs can be compressed in place, one segment of at most
+ * SEGMENT_SIZE characters at a time: the nodes of every segment are replaced by a single packed node, which
+ * keeps the segment's size (and hash and layout) like any other node, while its text is kept compressed in a
+ * process-wide table, keyed by the node. The segments are joined by ordinary one-character nodes, so a packed node is
+ * always a leaf, and it never gets splayed: a search which ends in it first unpacks it (_unpackSegment()) into a
+ * balanced subtree of the segment, in its place. So the first access to a cold tree rebuilds one segment, not the
+ * whole string, and an edit rebuilds at most the segments at its ends.
+ * Walks that only need sizes pass over packed nodes, and walks that read the text (_inOrderInto(), substring(),
+ * replaceAll(), ...) decompress it without unpacking the node.
+ * There are two codecs, and every segment takes the one that makes it smaller (see _segmentEncode()).
+ * The first one is a simple byte-oriented LZ77. The compressed stream is a sequence of:
+ * literal length (varint), literals, match length (varint), match offset (varint).
+ * The last sequence has no match, and the decoder knows when to stop, because it knows the string length.
+ * The second one bit-packs texts over small alphabets: every character is stored as its index in the alphabet of
+ * the text, in 2 bits for up to 4 distinct characters (e.g. DNA), or in 5 bits for up to 32 (e.g. lowercase
+ * English letters, as in the original problem). The frozen chunks are packed the same way. */
+
+#define LZ_MIN_MATCH 8
+#define LZ_HASH_BITS 14
+
+/* Advances the global access epoch. Meant to be called periodically by the user, e.g. once per request or timer tick. */
+static void advanceEpoch(void) {
+    ropeEpoch++;
+}
+
+static inline unsigned _lzHash(const char *p) {
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes x as a varint at out[*pos], and advances *pos. */
+static inline void _putVarint(unsigned char *out, unsigned *pos, unsigned x) {
+    while (x >= 0x80) {
+        out[(*pos)++] = (unsigned char)(x | 0x80);
+        x >>= 7;
     }
-    else
-        tree->root = Y;
+    out[(*pos)++] = (unsigned char)x;
+}
 
-    node->parent = Y;
-    Y->right = node;
-    if (B)
-        B->parent = node;
-    node->left = B;
+/* Reads a varint from in[*pos], and advances *pos. */
+static inline unsigned _getVarint(const unsigned char *in, unsigned *pos) {
+    unsigned x = 0, shift = 0;
+    unsigned char b;
+    do {
+        b = in[(*pos)++];
+        x |= (unsigned)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return x;
+}
 
-    node->size = (node->left ? node->left->size : 0) + (node->right ? node->right->size : 0) + 1;
-    Y->size = (Y->left ? Y->left->size : 0) + (Y->right ? Y->right->size : 0) + 1;
+/* Input: string src of length n; pointer to the output size.
+ * Returns a newly allocated compressed buffer, or NULL if the string doesn't compress (the output would be
+ * at least as long as the input). */
+static unsigned char *_lzCompress(const char *src, unsigned n, unsigned *outSize) {
+    unsigned *table = calloc(1u << LZ_HASH_BITS, sizeof(*table));   // positions + 1; 0 means empty
+    unsigned char *out = malloc(n + 16);
+    unsigned op = 0, anchor = 0, pos = 0;
+    while (n >= LZ_MIN_MATCH && pos <= n - LZ_MIN_MATCH) {
+        unsigned h = _lzHash(src + pos);
+        unsigned candidate = table[h];
+        table[h] = pos + 1;
+        if (!candidate || memcmp(src + candidate - 1, src + pos, LZ_MIN_MATCH)) {
+            pos++;
+            continue;
+        }
+        candidate--;
+        unsigned length = LZ_MIN_MATCH;
+        while (pos + length < n && src[candidate + length] == src[pos + length])
+            length++;
+        if (op + (pos - anchor) + 15 >= n)                      // three varints take at most 15 bytes
+            break;
+        _putVarint(out, &op, pos - anchor);
+        memcpy(out + op, src + anchor, pos - anchor);
+        op += pos - anchor;
+        _putVarint(out, &op, length);
+        _putVarint(out, &op, pos - candidate);
+        pos += length;
+        anchor = pos;
+    }
+    free(table);
+    if (op + (n - anchor) + 5 >= n) {
+        free(out);
+        return NULL;
+    }
+    _putVarint(out, &op, n - anchor);
+    memcpy(out + op, src + anchor, n - anchor);
+    op += n - anchor;
+    *outSize = op;
+    return realloc(out, op);
 }
 
-/* Input: Pointer to a tree, and a pointer to its node object that we want to rotate left.
- * Returns nothing.
- * Doesn't splay any node. */
-static void _rotateLeft(SplayTree *tree, Node *node) {
-    Node *parent = node->parent;
-    Node *X = node->right;
-    if (!X)
-        return;                                                 // we can't rotate the node with nothing!
-    Node *B = X->left;
-    X->parent = parent;
-    if (parent) {
-        if (node == parent->left)                               // node is left child
-            parent->left = X;
-        else                                                    // node is right child
-            parent->right = X;
+/* Input: compressed buffer src; array dst which receives exactly n characters. */
+static void _lzDecompress(const unsigned char *src, char *dst, unsigned n) {
+    unsigned ip = 0, produced = 0;
+    while (TRUE) {
+        unsigned literals = _getVarint(src, &ip);
+        memcpy(dst + produced, src + ip, literals);
+        ip += literals;
+        produced += literals;
+        if (produced >= n)
+            break;
+        unsigned length = _getVarint(src, &ip);
+        unsigned offset = _getVarint(src, &ip);
+        for (unsigned i = 0; i < length; i++, produced++)       // byte by byte, because the match may overlap itself
+            dst[produced] = dst[produced - offset];
     }
-    else
-        tree->root = X;
+}
 
-    node->parent = X;
-    X->left = node;
-    if (B)
-        B->parent = node;
-    node->right = B;
+/* Finds the alphabet of the n characters of text: codes[c] is the code of character c, and alphabet[code] is
+ * the character, for the first 32 codes. Stores the number of distinct characters in *distinct.
+ * Returns the bits per character: 2, 5, or 8 if the alphabet is too large to pack. */
+static unsigned _alphabetOf(const unsigned char *text, unsigned n, unsigned char *codes, char *alphabet, unsigned *distinct) {
+    char seen[256] = { 0 };
+    *distinct = 0;
+    for (unsigned i = 0; i < n; i++)
+        seen[text[i]] = TRUE;
+    for (unsigned c = 0; c < 256; c++)
+        if (seen[c]) {
+            if (*distinct < 32)
+                alphabet[*distinct] = (char)c;
+            codes[c] = (unsigned char)(*distinct)++;
+        }
+    return *distinct <= 4 ? 2 : (*distinct <= 32 ? 5 : 8);
+}
 
-    node->size = (node->left ? node->left->size : 0) + (node->right ? node->right->size : 0) + 1;
-    X->size = (X->left ? X->left->size : 0) + (X->right ? X->right->size : 0) + 1;
+/* Returns the size of n packed characters of the given bits, with one spare byte, so that 5-bit reads can always take two bytes. */
+static inline size_t _packedSize(unsigned n, unsigned bits) {
+    return (size_t)n * bits / 8 + 2;
 }
 
-/* Splays node to the top of the tree, making it new root of the tree.
- * Input: Pointer to a tree, and a pointer to its node object that we want to splay to the root.
- * Returns nothing. */
-static void _splay(SplayTree *tree, Node *node) {
-    if (!node)
-        return;
+/* Packs the codes of the n characters of text into out, which must be zeroed and _packedSize() bytes long. */
+static void _bitPack(const unsigned char *text, unsigned n, const unsigned char *codes, unsigned bits, unsigned char *out) {
+    if (bits == 2)
+        for (unsigned i = 0; i < n; i++)
+            out[i >> 2] |= codes[text[i]] << ((i & 3) * 2);
+    else
+        for (unsigned i = 0; i < n; i++) {
+            unsigned bit = i * 5, code = codes[text[i]] << (bit & 7);
+            out[bit >> 3] |= (unsigned char)code;
+            out[(bit >> 3) + 1] |= (unsigned char)(code >> 8);
+        }
+}
 
-    Node *parent = node->parent;
+/* Returns the code with the given rank from packed data. */
+static inline unsigned _bitCode(const unsigned char *data, unsigned bits, unsigned rank) {
+    if (bits == 2)
+        return (data[rank >> 2] >> ((rank & 3) * 2)) & 3;
+    unsigned bit = rank * 5;                                    // 5 bits may span two bytes
+    return ((data[bit >> 3] | (unsigned)data[(bit >> 3) + 1] << 8) >> (bit & 7)) & 31;
+}
 
-    while (parent) {
+/* Unpacks the characters [i..i+len-1] of packed data into out.
+ * The loops have no branches, so the compiler can vectorize them. */
+static void _bitUnpack(const unsigned char *data, unsigned bits, const char *alphabet, unsigned i, unsigned len, char *out) {
+    if (bits == 2)
+        for (unsigned x = 0; x < len; x++)
+            out[x] = alphabet[(data[(i + x) >> 2] >> (((i + x) & 3) * 2)) & 3];
+    else
+        for (unsigned x = 0; x < len; x++)
+            out[x] = alphabet[_bitCode(data, 5, i + x)];
+}
 
-        Node *left = node->left;
-        Node *right = node->right;
-        Node *grandParent = parent->parent;
+/* *** Background checkpoints *** */
 
-        if (!grandParent) {
-            /* Zig */
-            if (node == parent->left)
-                _rotateRight(tree, parent);
-            else
-                _rotateLeft(tree, parent);
-        }
+/* A checkpoint is a consistent snapshot of a tree, written to a file by a background thread.
+ * Splaying changes the tree even on reads, and nodes know their parents, so nodes can't be shared
+ * between the live tree and a snapshot. Instead, the snapshot is the flat string, and it's copied incrementally:
+ * every checkpointStep(), called by the writer between its edits, copies the next slice of at most "budget"
+ * characters with substring(), so no single call stalls the writer for O(n).
+ * Edits between the steps are accounted for with tree->editedFrom, the lowest rank that any edit has changed since
+ * the previous step (every editing operation that notifies the observer updates it). The copied prefix is still
+ * valid up to that rank, so only the part after it is copied again. When the copy reaches the end of the string,
+ * it's the string as it was at that step, and the background thread writes it out while the writer goes on.
+ * A writer that keeps editing near the start of the string delays the snapshot; checkpointWait() completes it in one go.
+ * A tree can have one checkpoint in progress at a time, and it must not be destroyed before its copy is complete.
+ * Without POSIX threads, the file is written synchronously at the last step. */
 
-        else if (node == parent->left) {
-            if (parent == grandParent->left) {
-                /* Zig-zig */
-                _rotateRight(tree, grandParent);
-                _rotateRight(tree, parent);
-            }
-            else {
-                /* Zig-zag (parent == grandParent.right) */
-                _rotateRight(tree, parent);
-                _rotateLeft(tree, grandParent);
-            }
-        }
+typedef struct Checkpoint Checkpoint;
 
-        else if (node == parent->right) {
-            if (parent == grandParent->right) {
-                /* Zig-zig */
-                _rotateLeft(tree, grandParent);
-                _rotateLeft(tree, parent);
-            }
-            else {
-                /* Zig-zag (parent == grandParent.left) */
-                _rotateLeft(tree, parent);
-                _rotateRight(tree, grandParent);
-            }
-        }
+/* Checkpoint "class" */
+struct Checkpoint {
+    SplayTree *tree;
+    char *text;                                                 // the snapshot
+    unsigned size, capacity;
+    unsigned copied;                                            // text[0..copied-1] is the current prefix of the string
+    char *path;
+    int writing;                                                // boolean; TRUE once the copy is complete
+    int ok;                                                     // boolean; result of the write
+#ifdef ROPE_POSIX
+    pthread_t thread;
+#endif // ROPE_POSIX
+};
 
-        parent = node->parent;
+/* Writes the snapshot to a temporary file, and then renames it to the final path,
+ * so that the previous checkpoint stays intact until the new one is complete. */
+static void *_writeCheckpoint(void *arg) {
+    Checkpoint *checkpoint = arg;
+    size_t len = strlen(checkpoint->path);
+    char *temporary = malloc(len + 5);
+    memcpy(temporary, checkpoint->path, len);
+    memcpy(temporary + len, ".tmp", 5);
+    FILE *file = fopen(temporary, "wb");
+    checkpoint->ok = file != NULL;
+    if (file) {
+        checkpoint->ok = fwrite(checkpoint->text, 1, checkpoint->size, file) == checkpoint->size;
+        checkpoint->ok = !fclose(file) && checkpoint->ok;
     }
+#ifndef ROPE_POSIX
+    remove(checkpoint->path);                                   // rename() doesn't replace existing files everywhere
+#endif // ROPE_POSIX
+    checkpoint->ok = checkpoint->ok && !rename(temporary, checkpoint->path);
+    free(temporary);
+    return NULL;
 }
 
-/* Input: Integer number k - the rank of a node (0 <= k < size of the whole tree).
- * Output: The k - th smallest element in the tree (a node object). Counting starts from 0.
- * This is a public method, which splays the found node to the top of the tree. */
-Node *orderStatisticZeroBasedRanking(SplayTree *tree, unsigned k) {
-#ifdef DEBUG
-    if (k >= tree->size || k < 0) {
-        printf("0 <= k < size of the whole tree\n");
-        exit(-1);
-    }
-#endif // DEBUG
-    Node *node = tree->root;
-    while (node) {
-        Node *left = node->left;
-        Node *right = node->right;
-        unsigned s = left ? left->size : 0;
-        if (k == s)
-            break;
-        else if (k < s) {
-            if (left) {
-                node = left;
-                continue;
-            }
-            break;
-        }
-        else {
-            if (right) {
-                k = k - s - 1;
-                node = right;
-                continue;
-            }
-            break;
-        }
-    }
-    _splay(tree, node);
-    return node;
+/* Starts a checkpoint of the tree to the file at path. Doesn't copy anything yet; see checkpointStep().
+ * Input: pointer to a tree; path of the checkpoint file.
+ * Returns a handle, which has to be passed to checkpointWait(). */
+static Checkpoint *checkpointAsync(SplayTree *tree, const char *path) {
+    Checkpoint *checkpoint = malloc(sizeof(Checkpoint));
+    checkpoint->tree = tree;
+    checkpoint->capacity = tree->size + 1;
+    checkpoint->text = malloc(checkpoint->capacity);
+    checkpoint->size = 0;
+    checkpoint->copied = 0;
+    checkpoint->path = malloc(strlen(path) + 1);
+    strcpy(checkpoint->path, path);
+    checkpoint->writing = FALSE;
+    checkpoint->ok = FALSE;
+    tree->editedFrom = (unsigned)-1;
+    return checkpoint;
 }
 
-/* We don't use key. We instead use rank as the position at which to insert a letter (node). */
-/* Input: rank is a numerical value (0 <= rank <= size of the whole tree); value is a lowercase English letter.
- * This is a general splay tree method, that works in general case.
- * Adds a node with letter "value" to the tree (string), at the position "rank". Numbering is 0-based.
- * Splays the node up to the top of the tree.
- * But, if we insert more than one character at one time (a string), it will also work. It will accept a string, and put it in a node.
- * Returns nothing.
- * Goes down from root to a leaf only once, and also goes up only once. */
-static void insert(SplayTree *tree, unsigned rank, char value) {
-#ifdef DEBUG
-    if (rank > tree->size || rank < 0) {
-        printf("0 <= rank <= size of the whole tree\n");
-        exit(-1);
+/* Copies the next slice of at most budget characters of the snapshot, after taking back the part of the copy
+ * that the edits since the previous step have changed. When the copy is complete, starts writing it.
+ * O(log n + budget). Returns TRUE if the copy is complete. */
+static int checkpointStep(Checkpoint *checkpoint, unsigned budget) {
+    SplayTree *tree = checkpoint->tree;
+    if (checkpoint->writing)
+        return TRUE;
+    if (tree->editedFrom < checkpoint->copied)
+        checkpoint->copied = tree->editedFrom;
+    if (tree->size < checkpoint->copied)                        // e.g. the tree was split up and joined again
+        checkpoint->copied = 0;
+    tree->editedFrom = (unsigned)-1;
+    if (checkpoint->capacity < tree->size + 1) {
+        checkpoint->capacity = tree->size + tree->size / 2 + 1;
+        checkpoint->text = realloc(checkpoint->text, checkpoint->capacity);
     }
-#endif // DEBUG
+    unsigned len = tree->size - checkpoint->copied < budget ? tree->size - checkpoint->copied : budget;
+    substring(tree, checkpoint->copied, len, checkpoint->text + checkpoint->copied);
+    checkpoint->copied += len;
+    if (checkpoint->copied < tree->size)
+        return FALSE;
+    checkpoint->size = checkpoint->copied;
+    checkpoint->writing = TRUE;
+#ifdef ROPE_POSIX
+    if (!pthread_create(&checkpoint->thread, NULL, _writeCheckpoint, checkpoint))
+        return TRUE;
+#endif // ROPE_POSIX
+    _writeCheckpoint(checkpoint);
+#ifdef ROPE_POSIX
+    checkpoint->thread = pthread_self();                        // marks that there's nothing to join
+#endif // ROPE_POSIX
+    return TRUE;
+}
 
-    Node *node = createNode(value);
+/* Completes the copy if it isn't complete yet, waits until the checkpoint is written, and frees the handle.
+ * Returns TRUE if the checkpoint was written successfully. */
+static int checkpointWait(Checkpoint *checkpoint) {
+    checkpointStep(checkpoint, (unsigned)-1);
+#ifdef ROPE_POSIX
+    if (!pthread_equal(checkpoint->thread, pthread_self()))
+        pthread_join(checkpoint->thread, NULL);
+#endif // ROPE_POSIX
+    int ok = checkpoint->ok;
+    free(checkpoint->text);
+    free(checkpoint->path);
+    free(checkpoint);
+    return ok;
+}
 
-    /* Inserting at the end of the whole text. */
-    if (rank == tree->size && tree->size > 0) {
+/* Builds a perfectly balanced subtree out of n runs of s, where run r is s[starts[r]..starts[r+1]-1], and returns its root. */
+static Node *_buildRuns(const char *s, const unsigned *starts, unsigned n, Node *parent) {
+    if (!n)
+        return NULL;
+    unsigned mid = n / 2;
+    Node *node = createNode(s[starts[mid]]);
+    node->count = starts[mid + 1] - starts[mid];
+    node->parent = parent;
+    node->child[LEFT] = _buildRuns(s, starts, mid, node);
+    node->child[RIGHT] = _buildRuns(s, starts + mid + 1, n - mid - 1, node);
+    _update(node);
+    return node;
+}
+
+/* Builds a perfectly balanced subtree out of n characters of s, with one node per run of equal characters,
+ * and returns its root. Recursion depth is only log(n). */
+static Node *_buildBalanced(const char *s, unsigned n, Node *parent) {
+    unsigned *starts = malloc((n + 1) * sizeof(*starts)), runs = 0;
+    for (unsigned i = 0; i < n; i++)
+        if (!i || s[i] != s[i - 1])
+            starts[runs++] = i;
+    starts[runs] = n;
+    Node *root = _buildRuns(s, starts, runs, parent);
+    free(starts);
+    return root;
+}
+
+#define SEGMENT_SIZE 16384
+#define SEGMENT_MIN 1024                                        // shorter pieces stay as nodes
+
+typedef struct Segment Segment;
+
+/* Segment "class": the compressed text of a packed node. */
+struct Segment {
+    Node *node;                                                 // NULL if the node is gone, but the segment is still being written
+    Segment *next;                                              // next segment in the same bucket of the table
+    unsigned char *data;                                        // NULL while the text is only in the page file
+    unsigned dataSize;
+    long slot;                                                  // slot in the page file, -1 if none
+    Segment *lruPrev, *lruNext;                                 // neighbours in the LRU list
+    Segment *writeNext;                                         // next segment in the write queue
+    char listed;                                                // boolean; TRUE while the segment is in the LRU list
+    char writing;                                               // boolean; TRUE until the background thread has written it
+};
+
+/* The process-wide table of segments, keyed by their node. Like the anchor table, it isn't synchronized. */
+static Segment **segmentTable = NULL;
+static unsigned segmentBits = 0, segmentCount = 0;              // the table has 2 ^ segmentBits buckets
+
+static inline unsigned _segmentBucket(const Node *node) {
+    return (unsigned)((uintptr_t)node / sizeof(Node) * 2654435761u) >> (32 - segmentBits);
+}
+
+static inline Segment *_findSegment(const Node *node) {
+    Segment *segment = segmentTable[_segmentBucket(node)];
+    while (segment->node != node)
+        segment = segment->next;
+    return segment;
+}
+
+/* Doubles the number of buckets of the segment table. */
+static void _growSegmentTable(void) {
+    Segment **old = segmentTable;
+    unsigned buckets = segmentBits ? 1u << segmentBits : 0;
+    segmentBits = segmentBits ? segmentBits + 1 : 8;
+    segmentTable = calloc((size_t)1 << segmentBits, sizeof(*segmentTable));
+    for (unsigned b = 0; b < buckets; b++)
+        while (old[b]) {
+            Segment *segment = old[b];
+            old[b] = segment->next;
+            Segment **bucket = &segmentTable[_segmentBucket(segment->node)];
+            segment->next = *bucket;
+            *bucket = segment;
+        }
+    free(old);
+}
+
+/* *** Page file *** */
+
+/* The compressed segments can be paged out to a page file, so that documents larger than memory can be edited:
+ * only the nodes stay in memory, and a packed segment of SEGMENT_SIZE characters costs two of them.
+ * The file is cut into slots of SEGMENT_SIZE bytes, which is more than any compressed segment takes, and the slots
+ * of freed segments are reused, so the file is never larger than the most segments paged out at the same time.
+ * All segments are kept in an LRU list, and while a page file is open, only the pageCapacity most recently used ones
+ * keep their text in memory. A segment is written out when it's evicted for the first time; segments never change,
+ * so its slot stays valid, and evicting it again only frees its memory. A paged-out segment is read back by the
+ * first access to its text, which is one read of one slot; so process() and the other edits, which unpack at most
+ * the segments at their ends, do a bounded amount of I/O.
+ * With POSIX threads, the writes are done by a background thread: an evicted segment keeps its text until the thread
+ * has written it, and it's freed by the next access to the page file after that. Without them, the writes are
+ * synchronous. Apart from the write queue, the page file isn't synchronized: like the segment table, it belongs to
+ * one thread at a time. */
+
+static FILE *pageFile = NULL;                                   // NULL while there's no page file
+static unsigned pageCapacity = 0, pageResident = 0;             // segments in the LRU list, at most pageCapacity while paging
+static Segment *pageHead = NULL, *pageTail = NULL;              // the most recently used segment first
+static long *freeSlots = NULL, slotCount = 0;                   // stack of reusable slots; slots in the file
+static unsigned freeSlotCount = 0, freeSlotCapacity = 0;
+#ifdef ROPE_POSIX
+static pthread_t pageWriter;
+static pthread_mutex_t pageLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pageWake = PTHREAD_COND_INITIALIZER;
+static Segment *writeQueue = NULL, *writeQueueTail = NULL;      // segments to be written, the oldest first
+static Segment *writeDone = NULL;                               // written segments, for _reapWrites()
+static char pageStopping = FALSE, pageFailed = FALSE;
+#endif // ROPE_POSIX
+
+static inline void _listSegment(Segment *segment) {
+    segment->lruPrev = NULL;
+    segment->lruNext = pageHead;
+    if (pageHead)
+        pageHead->lruPrev = segment;
+    else
+        pageTail = segment;
+    pageHead = segment;
+    segment->listed = TRUE;
+    pageResident++;
+}
+
+static inline void _unlistSegment(Segment *segment) {
+    if (!segment->listed)
+        return;
+    if (segment->lruPrev)
+        segment->lruPrev->lruNext = segment->lruNext;
+    else
+        pageHead = segment->lruNext;
+    if (segment->lruNext)
+        segment->lruNext->lruPrev = segment->lruPrev;
+    else
+        pageTail = segment->lruPrev;
+    segment->listed = FALSE;
+    pageResident--;
+}
+
+/* Frees the segment, and gives its slot back. */
+static void _freeSegment(Segment *segment) {
+    if (segment->slot >= 0) {
+        if (freeSlotCount == freeSlotCapacity) {
+            freeSlotCapacity = freeSlotCapacity ? 2 * freeSlotCapacity : 64;
+            freeSlots = realloc(freeSlots, freeSlotCapacity * sizeof(*freeSlots));
+        }
+        freeSlots[freeSlotCount++] = segment->slot;
+    }
+    free(segment->data);
+    free(segment);
+}
+
+static void _readSlot(Segment *segment) {
+    segment->data = malloc(segment->dataSize);
+#ifdef ROPE_POSIX
+    int ok = pread(fileno(pageFile), segment->data, segment->dataSize, (off_t)segment->slot * SEGMENT_SIZE) == (ssize_t)segment->dataSize;
+#else
+    int ok = !fseek(pageFile, segment->slot * SEGMENT_SIZE, SEEK_SET) &&
+             fread(segment->data, 1, segment->dataSize, pageFile) == segment->dataSize;
+#endif // ROPE_POSIX
+    if (!ok) {
+        printf("Can't read from the page file\n");
+        exit(-1);
+    }
+}
+
+static int _writeSlot(const Segment *segment) {
+#ifdef ROPE_POSIX
+    return pwrite(fileno(pageFile), segment->data, segment->dataSize, (off_t)segment->slot * SEGMENT_SIZE) == (ssize_t)segment->dataSize;
+#else
+    return !fseek(pageFile, segment->slot * SEGMENT_SIZE, SEEK_SET) &&
+           fwrite(segment->data, 1, segment->dataSize, pageFile) == segment->dataSize;
+#endif // ROPE_POSIX
+}
+
+#ifdef ROPE_POSIX
+
+/* The background thread, which writes the queued segments in order. */
+static void *_pageWriterThread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pageLock);
+    while (TRUE) {
+        while (!writeQueue && !pageStopping)
+            pthread_cond_wait(&pageWake, &pageLock);
+        Segment *segment = writeQueue;
+        if (!segment)
+            break;
+        writeQueue = segment->writeNext;
+        if (!writeQueue)
+            writeQueueTail = NULL;
+        pthread_mutex_unlock(&pageLock);
+        int ok = _writeSlot(segment);                           // the text doesn't change while the segment is queued
+        pthread_mutex_lock(&pageLock);
+        pageFailed = pageFailed || !ok;
+        segment->writeNext = writeDone;
+        writeDone = segment;
+    }
+    pthread_mutex_unlock(&pageLock);
+    return NULL;
+}
+
+/* Takes care of the segments which the background thread has written since the last call:
+ * frees the ones whose node is gone, and the text of the ones which weren't used again after their eviction. */
+static void _reapWrites(void) {
+    pthread_mutex_lock(&pageLock);
+    Segment *segment = writeDone;
+    int failed = pageFailed;
+    writeDone = NULL;
+    pthread_mutex_unlock(&pageLock);
+    if (failed) {
+        printf("Can't write to the page file\n");
+        exit(-1);
+    }
+    while (segment) {
+        Segment *next = segment->writeNext;
+        segment->writing = FALSE;
+        if (!segment->node)
+            _freeSegment(segment);
+        else if (!segment->listed) {
+            free(segment->data);
+            segment->data = NULL;
+        }
+        segment = next;
+    }
+}
+
+#endif // ROPE_POSIX
+
+/* Pages out the least recently used segments while more than pageCapacity of them are in memory. */
+static void _evictSegments(void) {
+    while (pageFile && pageResident > pageCapacity) {
+        Segment *victim = pageTail;
+        _unlistSegment(victim);
+        if (victim->writing)                                    // still queued; _reapWrites() frees its text
+            continue;
+        if (victim->slot < 0) {
+            victim->slot = freeSlotCount ? freeSlots[--freeSlotCount] : slotCount++;
+#ifdef ROPE_POSIX
+            victim->writing = TRUE;
+            victim->writeNext = NULL;
+            pthread_mutex_lock(&pageLock);
+            if (writeQueueTail)
+                writeQueueTail->writeNext = victim;
+            else
+                writeQueue = victim;
+            writeQueueTail = victim;
+            pthread_cond_signal(&pageWake);
+            pthread_mutex_unlock(&pageLock);
+            continue;
+#else
+            if (!_writeSlot(victim)) {
+                printf("Can't write to the page file\n");
+                exit(-1);
+            }
+#endif // ROPE_POSIX
+        }
+        free(victim->data);
+        victim->data = NULL;
+    }
+}
+
+/* Makes the segment the most recently used one, reading its text back from the page file if needed. */
+static void _touchSegment(Segment *segment) {
+#ifdef ROPE_POSIX
+    if (pageFile)
+        _reapWrites();
+#endif // ROPE_POSIX
+    if (!segment->data)
+        _readSlot(segment);
+    if (pageHead == segment)
+        return;
+    _unlistSegment(segment);
+    _listSegment(segment);
+    _evictSegments();
+}
+
+/* Opens a page file at path, which gets created (or truncated). From now on, only the compressed text of
+ * the capacity (at least 1) most recently used segments is kept in memory.
+ * Returns FALSE if a page file is already open, or if the file can't be created. */
+static int openPageFile(const char *path, unsigned capacity) {
+    if (pageFile || !(pageFile = fopen(path, "w+b")))
+        return FALSE;
+    pageCapacity = capacity ? capacity : 1;
+#ifdef ROPE_POSIX
+    pageStopping = FALSE;
+    pageFailed = FALSE;
+    if (pthread_create(&pageWriter, NULL, _pageWriterThread, NULL)) {
+        fclose(pageFile);
+        pageFile = NULL;
+        return FALSE;
+    }
+#endif // ROPE_POSIX
+    _evictSegments();
+    return TRUE;
+}
+
+/* Waits for the pending writes, reads all the paged-out segments back into memory, and closes the page file. */
+static void closePageFile(void) {
+    if (!pageFile)
+        return;
+#ifdef ROPE_POSIX
+    pthread_mutex_lock(&pageLock);
+    pageStopping = TRUE;
+    pthread_cond_signal(&pageWake);
+    pthread_mutex_unlock(&pageLock);
+    pthread_join(pageWriter, NULL);
+    _reapWrites();
+#endif // ROPE_POSIX
+    for (unsigned b = 0; segmentTable && b < 1u << segmentBits; b++)
+        for (Segment *segment = segmentTable[b]; segment; segment = segment->next) {
+            if (!segment->data)
+                _readSlot(segment);
+            if (!segment->listed)
+                _listSegment(segment);
+            segment->slot = -1;
+        }
+    fclose(pageFile);
+    pageFile = NULL;
+    free(freeSlots);
+    freeSlots = NULL;
+    freeSlotCount = freeSlotCapacity = 0;
+    slotCount = 0;
+}
+
+/* Frees the segment of the node, and the table together with the last segment. */
+static void _dropSegment(Node *node) {
+    Segment **link = &segmentTable[_segmentBucket(node)];
+    while ((*link)->node != node)
+        link = &(*link)->next;
+    Segment *segment = *link;
+    *link = segment->next;
+    _unlistSegment(segment);
+    if (segment->writing)                                       // freed by _reapWrites()
+        segment->node = NULL;
+    else
+        _freeSegment(segment);
+    node->packed = FALSE;
+    if (--segmentCount)
+        return;
+    free(segmentTable);
+    segmentTable = NULL;
+    segmentBits = 0;
+}
+
+static void _segmentText(const Node *node, char *out) {
+    Segment *segment = _findSegment(node);
+    _touchSegment(segment);
+    const unsigned char *data = segment->data;
+    if (data[0] == 8)
+        _lzDecompress(data + 1, out, node->count);
+    else
+        _bitUnpack(data + 2 + data[1], data[0], (const char *)data + 2, 0, node->count, out);
+}
+
+/* Creates a packed node for n characters, compressed into data, and returns it. */
+static Node *_packedNode(unsigned char *data, unsigned dataSize, unsigned n) {
+    Node *node = createNode(0);
+    node->count = n;
+    node->size = n;
+    node->packed = TRUE;
+    if (segmentCount >= (segmentBits ? 1u << segmentBits : 0))
+        _growSegmentTable();
+    segmentCount++;
+    Segment *segment = malloc(sizeof(Segment));
+    segment->node = node;
+    segment->data = data;
+    segment->dataSize = dataSize;
+    segment->slot = -1;
+    segment->listed = FALSE;
+    segment->writing = FALSE;
+    Segment **bucket = &segmentTable[_segmentBucket(node)];
+    segment->next = *bucket;
+    *bucket = segment;
+    _touchSegment(segment);
+#if defined(ROPE_HASH) || defined(ROPE_LAYOUT)
+    char *text = malloc(n);                                     // the aggregates of the text, computed the usual way
+    SplayTree subtree = { 0 };
+    _segmentText(node, text);
+    subtree.root = _buildBalanced(text, n, NULL);
+    subtree.size = n;
+#ifdef ROPE_HASH
+    node->hash = subtree.root->hash;
+    node->power = subtree.root->power;
+#endif // ROPE_HASH
+#ifdef ROPE_LAYOUT
+    node->layout = subtree.root->layout;
+#endif // ROPE_LAYOUT
+    postOrderFree(&subtree);
+    free(text);
+#endif // ROPE_HASH || ROPE_LAYOUT
+    return node;
+}
+
+/* Replaces the packed node by a balanced subtree of its text, and returns the root of that subtree.
+ * The text doesn't change, so the ancestors of the node stay up to date. */
+static Node *_unpackSegment(SplayTree *tree, Node *node) {
+    char *text = malloc(node->count);
+    Node *parent = node->parent;
+    _segmentText(node, text);
+    Node *root = _buildBalanced(text, node->count, parent);
+    free(text);
+    if (parent)
+        parent->child[parent->child[RIGHT] == node] = root;
+    else
+        tree->root = root;
+    _dropSegment(node);
+    destroyNode(node);
+    return root;
+}
+
+static inline void _touch(SplayTree *tree) {
+    tree->lastAccess = ropeEpoch;
+}
+
+/* Piece of a tree being compressed: a packed node that is kept, a compressed segment, or a piece of text that doesn't compress. */
+typedef struct {
+    Node *node;
+    unsigned char *data;                                        // compressed, if node is NULL; plain text, if dataSize is 0
+    unsigned dataSize;
+    unsigned length;
+} SegmentPiece;
+
+/* Input: string text of length n; pointer to the output size.
+ * Returns a newly allocated encoding of the text with the codec that makes it smaller. Its first byte is the number
+ * of bits per character: 2 or 5 if it's bit-packed, followed by the size of the alphabet, the alphabet and the codes;
+ * or 8 if it's compressed with LZ77, followed by the compressed stream.
+ * Returns NULL if neither is smaller than the text. */
+static unsigned char *_segmentEncode(const char *text, unsigned n, unsigned *outSize) {
+    unsigned char codes[256];
+    char alphabet[32];
+    unsigned distinct, lzSize;
+    unsigned bits = _alphabetOf((const unsigned char *)text, n, codes, alphabet, &distinct);
+    unsigned char *lz = _lzCompress(text, n, &lzSize);
+    size_t packedSize = bits == 8 ? n : 2 + distinct + _packedSize(n, bits);
+    if (packedSize < n && (!lz || packedSize <= lzSize + 1)) {
+        free(lz);
+        unsigned char *out = calloc(packedSize, 1);
+        out[0] = (unsigned char)bits;
+        out[1] = (unsigned char)distinct;
+        memcpy(out + 2, alphabet, distinct);
+        _bitPack((const unsigned char *)text, n, codes, bits, out + 2 + distinct);
+        *outSize = (unsigned)packedSize;
+        return out;
+    }
+    if (!lz)
+        return NULL;
+    unsigned char *out = malloc(lzSize + 1);
+    out[0] = 8;
+    memcpy(out + 1, lz, lzSize);
+    free(lz);
+    *outSize = lzSize + 1;
+    return out;
+}
+
+/* Adds the first n characters of text to the pieces. */
+static void _addPiece(SegmentPiece *piece, const char *text, unsigned n) {
+    piece->node = NULL;
+    piece->length = n;
+    piece->dataSize = 0;
+    piece->data = n >= SEGMENT_MIN ? _segmentEncode(text, n, &piece->dataSize) : NULL;
+    if (piece->data)
+        return;
+    piece->data = malloc(n);
+    memcpy(piece->data, text, n);
+}
+
+/* Compresses the tree in place if it hasn't been accessed during the last maxAge epochs.
+ * Walks the nodes in order, and cuts their text into segments of SEGMENT_SIZE characters, each followed by
+ * a one-character separator node; the segments that compress become packed nodes, and the pieces are joined into
+ * a balanced tree with _concatPieces(). Packed nodes which are still there from a previous call are kept as they are,
+ * so only the segments that were unpacked since then are compressed again. The new nodes are only created after all
+ * the old ones are freed, so that they don't pin the slabs of the old nodes. O(n).
+ * Trees with anchors on their characters, or with attributes, are never compressed.
+ * Input: pointer to a tree; maximum age in epochs (0 compresses it whatever its age, e.g. right after loading it).
+ * Returns TRUE if some segment got compressed; FALSE if the tree is still warm, or if there was nothing to compress. */
+static int compressIfCold(SplayTree *tree, unsigned long maxAge) {
+    if (!tree->root || ropeEpoch - tree->lastAccess < maxAge)
+        return FALSE;
+    if (tree->root->anchored || tree->root->styled)             // anchors point to the nodes, and the packed text has no attributes
+        return FALSE;
+    char *text = malloc(SEGMENT_SIZE + 1);                      // the current piece, and the separator after it
+    unsigned len = 0, pieceCount = 0, separatorCount = 0, capacity = 64, stackCapacity = 64;
+    int compressed = FALSE;
+    SegmentPiece *pieces = malloc(capacity * sizeof(*pieces));
+    char *values = malloc(capacity);                            // the characters of the separators
+    Node **stack = malloc(stackCapacity * sizeof(*stack));
+    size_t stackIndex = 0;
+    Node *node = tree->root;
+    while (node || stackIndex) {
+        while (node) {
+            if (stackIndex == stackCapacity) {
+                stackCapacity *= 2;
+                stack = realloc(stack, stackCapacity * sizeof(*stack));
+            }
+            stack[stackIndex++] = node;
+            node = node->child[LEFT];
+        }
+        node = stack[--stackIndex];
+        Node *next = node->child[RIGHT];
+        if (pieceCount + 2 > capacity) {
+            capacity *= 2;
+            pieces = realloc(pieces, capacity * sizeof(*pieces));
+            values = realloc(values, capacity);
+        }
+        if (node->packed) {                                     // kept as a piece of its own; the text before it is cut off
+            if (len) {                                          // a packed node always follows a character node
+                values[separatorCount++] = text[len - 1];
+                _addPiece(&pieces[pieceCount++], text, len - 1);
+                len = 0;
+            }
+            pieces[pieceCount++].node = node;
+        }
+        else {
+            unsigned count = node->count;
+            if (pieceCount > separatorCount) {                  // the character after a packed node separates it from the next piece
+                values[separatorCount++] = node->value;
+                count--;
+            }
+            while (count) {
+                unsigned chunk = SEGMENT_SIZE + 1 - len < count ? SEGMENT_SIZE + 1 - len : count;
+                memset(text + len, node->value, chunk);
+                len += chunk;
+                count -= chunk;
+                if (len == SEGMENT_SIZE + 1) {
+                    _addPiece(&pieces[pieceCount++], text, SEGMENT_SIZE);
+                    values[separatorCount++] = text[SEGMENT_SIZE];
+                    len = 0;
+                    if (pieceCount + 2 > capacity) {
+                        capacity *= 2;
+                        pieces = realloc(pieces, capacity * sizeof(*pieces));
+                        values = realloc(values, capacity);
+                    }
+                }
+            }
+            destroyNode(node);
+        }
+        node = next;
+    }
+    if (pieceCount == separatorCount)
+        _addPiece(&pieces[pieceCount++], text, len);
+    Node **roots = malloc(pieceCount * sizeof(*roots));
+    Node **separators = malloc(capacity * sizeof(*separators));
+    for (unsigned i = 0; i < pieceCount; i++) {
+        SegmentPiece *piece = &pieces[i];
+        if (piece->node) {
+            roots[i] = piece->node;
+            roots[i]->parent = NULL;
+            continue;
+        }
+        if (piece->dataSize) {
+            roots[i] = _packedNode(piece->data, piece->dataSize, piece->length);
+            compressed = TRUE;
+            continue;
+        }
+        roots[i] = _buildBalanced((char *)piece->data, piece->length, NULL);
+        free(piece->data);
+    }
+    for (unsigned i = 0; i < separatorCount; i++)
+        separators[i] = createNode(values[i]);
+    tree->root = _concatPieces(roots, separators, 0, pieceCount - 1);
+    tree->root->parent = NULL;
+    free(text);
+    free(pieces);
+    free(values);
+    free(stack);
+    free(roots);
+    free(separators);
+    return compressed;
+}
+
+/* Input: Pointer to a tree, a pointer to its node object that we want to rotate, and the direction of the rotation
+ *     (RIGHT lifts the left child of the node, LEFT lifts the right child).
+ * The two mirror-image rotations are the same code, with the child indices swapped.
+ * Returns nothing.
+ * Doesn't splay any node. */
+static inline void _rotate(SplayTree *tree, Node *node, int dir) {
+    Node *parent = node->parent;
+    Node *Y = node->child[!dir];
+    if (!Y)
+        return;                                                 // we can't rotate the node with nothing!
+    Node *B = Y->child[dir];
+    Y->parent = parent;
+    if (parent)
+        parent->child[node == parent->child[RIGHT]] = Y;        // node's side in its parent
+    else
+        tree->root = Y;
+
+    node->parent = Y;
+    Y->child[dir] = node;
+    if (B)
+        B->parent = node;
+    node->child[!dir] = B;
+
+    _update(node);
+    _update(Y);
+}
+
+/* Splays node to the top of the tree, making it new root of the tree.
+ * Input: Pointer to a tree, and a pointer to its node object that we want to splay to the root.
+ * Every step is described by the sides of the node and of its parent: the same sides mean zig-zig,
+ * different sides mean zig-zag. The mirror-image cases share the code.
+ * Returns nothing. */
+static void _splay(SplayTree *tree, Node *node) {
+    if (!node)
+        return;
+
+    Node *parent = node->parent;
+
+    while (parent) {
+
+        Node *grandParent = parent->parent;
+        int side = node == parent->child[RIGHT];
+
+        if (!grandParent) {
+            /* Zig */
+            _rotate(tree, parent, !side);
+        }
+
+        else if (side == (parent == grandParent->child[RIGHT])) {
+            /* Zig-zig */
+            _rotate(tree, grandParent, !side);
+            _rotate(tree, parent, !side);
+        }
+
+        else {
+            /* Zig-zag */
+            _rotate(tree, parent, !side);
+            _rotate(tree, grandParent, side);
+        }
+
+        parent = node->parent;
+    }
+}
+
+/* Input: Integer number k - the rank of a node (0 <= k < size of the whole tree).
+ * Output: The k - th smallest element in the tree (a node object). Counting starts from 0.
+ * This is a public method, which splays the found node to the top of the tree. */
+Node *orderStatisticZeroBasedRanking(SplayTree *tree, unsigned k) {
+#ifdef DEBUG
+    if (k >= tree->size || k < 0) {
+        printf("0 <= k < size of the whole tree\n");
+        exit(-1);
+    }
+#endif // DEBUG
+    _touch(tree);
+    Node *node = tree->root;
+    while (node) {
+        Node *left = node->child[LEFT];
+        Node *right = node->child[RIGHT];
+        unsigned s = left ? left->size : 0;
+        if (k - s < node->count) {                              // the rank falls inside the node's run (wraps around if k < s)
+            if (!node->packed)
+                break;
+            node = _unpackSegment(tree, node);                  // and then, the search goes on in its subtree
+            continue;
+        }
+        else if (k < s) {
+            if (left) {
+                node = left;
+                continue;
+            }
+            break;
+        }
+        else {
+            if (right) {
+                k = k - s - node->count;
+                node = right;
+                continue;
+            }
+            break;
+        }
+    }
+    _splay(tree, node);
+    return node;
+}
+
+/* Input: pointer to a tree; sorted array of n ranks (0 <= rank < size of the whole tree; duplicates are allowed);
+ *     array result of n characters.
+ * Output: result[i] is the character with rank ranks[i].
+ * This is a batched version of orderStatisticZeroBasedRanking(), which visits all the ranks in one traversal.
+ * It keeps the path from the root to the previously found node, and for every next rank it only climbs up to
+ * the lowest node of that path whose subtree contains the rank, and descends from there.
+ * That way the common prefixes of the paths are walked only once.
+ * Doesn't splay any node, because the nodes are found in order and the tree shouldn't change shape under the traversal;
+ * for the same reason, packed segments are decompressed, but not unpacked. */
+static void orderStatisticMany(SplayTree *tree, const unsigned *ranks, unsigned n, char *result) {
+    typedef struct {
+        Node *node;
+        unsigned base;                                          // rank of the leftmost node in the subtree
+    } Frame;
+    unsigned capacity = 64, depth = 0;
+    Frame *path = malloc(capacity * sizeof(*path));
+    char *text = NULL;                                          // the text of the packed node last visited
+    const Node *decoded = NULL;
+    _touch(tree);
+    if (!tree->root) {
+        free(path);
+        return;
+    }
+    path[depth].node = tree->root;
+    path[depth++].base = 0;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned k = ranks[i];
+        while (depth > 1 && (k < path[depth - 1].base || k >= path[depth - 1].base + path[depth - 1].node->size))
+            depth--;
+        Node *node = path[depth - 1].node;
+        unsigned base = path[depth - 1].base;
+        while (TRUE) {
+            unsigned s = base + (node->child[LEFT] ? node->child[LEFT]->size : 0);
+            if (k >= s && k < s + node->count)
+                break;
+            if (k > s)
+                base = s + node->count;
+            node = k < s ? node->child[LEFT] : node->child[RIGHT];
+            if (depth == capacity) {
+                capacity *= 2;
+                path = realloc(path, capacity * sizeof(*path));
+            }
+            path[depth].node = node;
+            path[depth++].base = base;
+        }
+        if (node->packed && node != decoded) {
+            text = realloc(text, node->count);
+            _segmentText(node, text);
+            decoded = node;
+        }
+        result[i] = node->packed ? text[k - base] : node->value;     // a packed node is a leaf
+    }
+    free(text);
+    free(path);
+}
+
+/* Copies the substring S[i..i+len-1] into out (0 <= i <= i + len <= size of the whole tree). Doesn't add '\0'.
+ * Splays the node with rank i to the root, and then traverses its right subtree in order, stopping after len characters.
+ * That's O(log n + len); packed segments in the range are decompressed, but stay packed. */
+static void substring(SplayTree *tree, unsigned i, unsigned len, char *out) {
+    if (!len)
+        return;
+    Node *node = orderStatisticZeroBasedRanking(tree, i);
+    unsigned offset = i - (node->child[LEFT] ? node->child[LEFT]->size : 0);
+    unsigned index = node->count - offset < len ? node->count - offset : len, capacity = 64;
+    Node **stack = malloc(capacity * sizeof(*stack));
+    size_t stackIndex = 0;
+    memset(out, node->value, index);                            // the rest of the first run
+    node = node->child[RIGHT];
+    while (index < len) {
+        while (node) {
+            if (stackIndex == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(*stack));
+            }
+            stack[stackIndex++] = node;
+            node = node->child[LEFT];
+        }
+        node = stack[--stackIndex];
+        unsigned count = node->count < len - index ? node->count : len - index;
+        if (!node->packed)
+            memset(out + index, node->value, count);            // visit()
+        else if (count == node->count)
+            _segmentText(node, out + index);
+        else {                                                  // only a prefix of the segment is needed
+            char *text = malloc(node->count);
+            _segmentText(node, text);
+            memcpy(out + index, text, count);
+            free(text);
+        }
+        index += count;
+        node = node->child[RIGHT];
+    }
+    free(stack);
+}
+
+#ifdef ROPE_HASH
+
+/* Returns the hash of the first p characters of the string (0 <= p <= size of the whole tree).
+ * Descends once from the root, and splays the last visited node. */
+static unsigned long long _prefixHash(SplayTree *tree, unsigned p) {
+    unsigned long long hash = 0;
+    Node *node = tree->root, *last = NULL;
+    while (node && p) {
+        if (node->packed) {
+            node = _unpackSegment(tree, node);
+            continue;
+        }
+        last = node;
+        Node *left = node->child[LEFT];
+        unsigned s = left ? left->size : 0;
+        if (p <= s) {
+            node = left;
+            continue;
+        }
+        if (left)
+            hash = _modHash(_mulHash(hash, left->power) + left->hash);
+        unsigned count = p - s < node->count ? p - s : node->count;     // the prefix may end inside the run
+        unsigned long long runHash, runPower;
+        _runHash((unsigned char)node->value, count, &runHash, &runPower);
+        hash = _modHash(_mulHash(hash, runPower) + runHash);
+        p -= s + count;
+        node = node->child[RIGHT];
+    }
+    _splay(tree, last);
+    return hash;
+}
+
+/* Returns the hash of len characters starting at rank i, given the hash of the first i characters. */
+static inline unsigned long long _rangeHash(SplayTree *tree, unsigned long long prefixHash, unsigned i, unsigned len) {
+    unsigned long long hash = _prefixHash(tree, i + len);
+    return _modHash(hash + HASH_MOD - _mulHash(prefixHash, _powHash(len)));
+}
+
+/* Returns the length of the longest common prefix of the suffixes starting at ranks p1 and p2
+ * (0 <= p1, p2 <= size of the whole tree), but not more than limit.
+ * Binary search over the length, comparing hashes of ranges, so it's O(log^2 n).
+ * Equal hashes are taken to mean equal strings; the probability of a false match is about n / 2^61. */
+static unsigned _longestCommonPrefix(SplayTree *tree, unsigned p1, unsigned p2, unsigned limit) {
+    _touch(tree);
+    unsigned n = tree->size;
+    unsigned lo = 0, hi = n - (p1 > p2 ? p1 : p2);
+    if (hi > limit)
+        hi = limit;
+    if (p1 == p2)
+        return hi;
+    unsigned long long prefix1 = _prefixHash(tree, p1), prefix2 = _prefixHash(tree, p2);
+    while (lo < hi) {                                           // invariant: the answer is in [lo, hi]
+        unsigned mid = lo + (hi - lo + 1) / 2;
+        if (_rangeHash(tree, prefix1, p1, mid) == _rangeHash(tree, prefix2, p2, mid))
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+#else
+
+/* The same, without hashes: compares the two suffixes block by block, so it's O(log n + answer). */
+static unsigned _longestCommonPrefix(SplayTree *tree, unsigned p1, unsigned p2, unsigned limit) {
+    char a[256], b[256];
+    unsigned lcp = 0, hi = tree->size - (p1 > p2 ? p1 : p2);
+    if (hi > limit)
+        hi = limit;
+    if (p1 == p2)
+        return hi;
+    while (lcp < hi) {
+        unsigned len = hi - lcp < sizeof(a) ? hi - lcp : (unsigned)sizeof(a);
+        substring(tree, p1 + lcp, len, a);
+        substring(tree, p2 + lcp, len, b);
+        for (unsigned x = 0; x < len; x++)
+            if (a[x] != b[x])
+                return lcp + x;
+        lcp += len;
+    }
+    return lcp;
+}
+
+#endif // ROPE_HASH
+
+/* Returns the length of the longest common prefix of the suffixes of the string starting at ranks p1 and p2. */
+static unsigned longestCommonPrefix(SplayTree *tree, unsigned p1, unsigned p2) {
+    return _longestCommonPrefix(tree, p1, p2, (unsigned)-1);
+}
+
+/* Compares the substrings S[i1..j1] and S[i2..j2] lexicographically (as unsigned characters).
+ * Returns a negative number, zero, or a positive number, like strcmp().
+ * Finds their longest common prefix (with hashes, if ROPE_HASH is defined), and then compares only the first differing characters. */
+static int compareRanges(SplayTree *tree, unsigned i1, unsigned j1, unsigned i2, unsigned j2) {
+    unsigned len1 = j1 - i1 + 1, len2 = j2 - i2 + 1;
+    unsigned limit = len1 < len2 ? len1 : len2;
+    unsigned lcp = _longestCommonPrefix(tree, i1, i2, limit);
+    if (lcp == limit)
+        return len1 < len2 ? -1 : (len1 > len2);
+    unsigned char c1 = orderStatisticZeroBasedRanking(tree, i1 + lcp)->value;
+    unsigned char c2 = orderStatisticZeroBasedRanking(tree, i2 + lcp)->value;
+    return c1 < c2 ? -1 : (c1 > c2);
+}
+
+#ifdef ROPE_LAYOUT
+
+/* Returns the column at which the character with the given rank starts (0 <= rank <= size of the whole tree),
+ * counting from 0 at the start of its line; rank == size gives the column at the end of the text.
+ * Descends once from the root, composing the layouts of the text before the rank, and splays the last visited node. */
+static unsigned columnOf(SplayTree *tree, unsigned rank) {
+    Layout prefix = { 0, 0, 0, 0 }, run;
+    _touch(tree);
+    Node *node = tree->root, *last = NULL;
+    while (node && rank) {
+        if (node->packed) {
+            node = _unpackSegment(tree, node);
+            continue;
+        }
+        last = node;
+        Node *left = node->child[LEFT];
+        unsigned s = left ? left->size : 0;
+        if (rank <= s) {
+            node = left;
+            continue;
+        }
+        if (left)
+            _composeLayout(&prefix, &prefix, &left->layout);
+        unsigned count = rank - s < node->count ? rank - s : node->count;     // the prefix may end inside the run
+        _runLayout(&run, (unsigned char)node->value, count);
+        _composeLayout(&prefix, &prefix, &run);
+        rank -= s + count;
+        node = node->child[RIGHT];
+    }
+    _splay(tree, last);
+    return _endColumn(&prefix);
+}
+
+/* Returns TRUE if the text of the layout goes past the given column of the given line. */
+static inline int _layoutPast(const Layout *layout, unsigned line, unsigned column) {
+    return layout->newlines > line || (layout->newlines == line && _endColumn(layout) > column);
+}
+
+/* Returns the rank of the character that covers the given column of the given line (both counted from 0).
+ * If the line is shorter than that, returns the rank of its '\n', or the size of the text if it's the last line
+ * or if there's no such line.
+ * The answer is the last rank before which the text doesn't go past the column yet, which is monotone, so it's found
+ * by one descent from the root; inside a run the length is found by binary search. Splays the found node. */
+static unsigned offsetAtColumn(SplayTree *tree, unsigned line, unsigned column) {
+    Layout prefix = { 0, 0, 0, 0 }, before, after, run;
+    unsigned base = 0;                                          // rank of the first character of the subtree
+    _touch(tree);
+    Node *node = tree->root, *last = NULL;
+    while (node) {
+        if (node->packed) {
+            node = _unpackSegment(tree, node);
+            continue;
+        }
+        last = node;
+        Node *left = node->child[LEFT];
+        before = prefix;
+        if (left)
+            _composeLayout(&before, &prefix, &left->layout);
+        if (_layoutPast(&before, line, column)) {
+            node = left;
+            continue;
+        }
+        base += left ? left->size : 0;
+        _runLayout(&run, (unsigned char)node->value, node->count);
+        _composeLayout(&after, &before, &run);
+        if (_layoutPast(&after, line, column)) {
+            unsigned lo = 1, hi = node->count;                  // the shortest part of the run that goes past
+            while (lo < hi) {
+                unsigned mid = lo + (hi - lo) / 2;
+                _runLayout(&run, (unsigned char)node->value, mid);
+                _composeLayout(&after, &before, &run);
+                if (_layoutPast(&after, line, column))
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            _splay(tree, node);
+            return base + lo - 1;
+        }
+        prefix = after;
+        base += node->count;
+        node = node->child[RIGHT];
+    }
+    _splay(tree, last);
+    return tree->size;
+}
+
+#endif // ROPE_LAYOUT
+
+/* Makes the character with the given rank (0 <= rank < size of the whole tree) the first one of its node,
+ * by cutting the run that contains it in two, and splays that node to the root. Returns the node.
+ * The head of the run keeps the original node, so anchors stay where they were. O(1) after the search. */
+static Node *_isolate(SplayTree *tree, unsigned rank) {
+    Node *head = orderStatisticZeroBasedRanking(tree, rank);
+    unsigned offset = rank - (head->child[LEFT] ? head->child[LEFT]->size : 0);
+    if (!offset)
+        return head;
+    Node *tail = createNode(head->value);
+    tail->attribute = head->attribute;
+    tail->count = head->count - offset;
+    head->count = offset;
+    tail->child[RIGHT] = head->child[RIGHT];
+    if (tail->child[RIGHT])
+        tail->child[RIGHT]->parent = tail;
+    head->child[RIGHT] = NULL;
+    _update(head);
+    tail->child[LEFT] = head;
+    head->parent = tail;
+    _update(tail);
+    tree->root = tail;
+    return tail;
+}
+
+/* We don't use key. We instead use rank as the position at which to insert a letter (node). */
+/* Input: rank is a numerical value (0 <= rank <= size of the whole tree); value is a lowercase English letter.
+ * This is a general splay tree method, that works in general case.
+ * Adds a node with letter "value" to the tree (string), at the position "rank". Numbering is 0-based.
+ * Splays the node up to the top of the tree.
+ * But, if we insert more than one character at one time (a string), it will also work. It will accept a string, and put it in a node.
+ * Returns nothing.
+ * Goes down from root to a leaf only once, and also goes up only once. */
+static void insert(SplayTree *tree, unsigned rank, char value) {
+#ifdef DEBUG
+    if (rank > tree->size || rank < 0) {
+        printf("0 <= rank <= size of the whole tree\n");
+        exit(-1);
+    }
+#endif // DEBUG
+
+    _touch(tree);
+
+    /* Extending the run which ends right before the position. */
+    if (rank > 0) {
+        Node *previous = orderStatisticZeroBasedRanking(tree, rank - 1);
+        unsigned end = (previous->child[LEFT] ? previous->child[LEFT]->size : 0) + previous->count;
+        if (previous->value == value && !previous->attribute && end == rank) {
+            previous->count++;
+            _update(previous);
+            tree->size++;
+            _notify(tree, EDIT_REPLACE, rank, 0, rank, 1);
+            return;
+        }
+    }
+    Node *node = createNode(value);
+
+    /* Inserting at the end of the whole text. */
+    if (rank == tree->size && tree->size > 0) {
         Node *last = orderStatisticZeroBasedRanking(tree, rank - 1);    // Or, subtreeMaximum(tree, root)
-        node->left = last;
-        node->size = last->size + 1;
+        node->child[LEFT] = last;
+        _update(node);
         last->parent = node;
         tree->size++;                                                   // Tree size
         tree->root = node;
+        _notify(tree, EDIT_REPLACE, rank, 0, rank, 1);
+        return;
+    }
+
+    /* Inserting in the middle (or at the beginning). */
+    if (tree->size == 0) {
+        /* The tree is empty. */
+        tree->size++;                                                   // Tree size
+        tree->root = node;
+        _notify(tree, EDIT_REPLACE, rank, 0, rank, 1);
+        return;
+    }
+    Node *right = _isolate(tree, rank);                                 // This will be right node of the newly inserted node.
+    node->child[RIGHT] = right;
+    node->child[LEFT] = right->child[LEFT];
+    if (node->child[LEFT])
+        node->child[LEFT]->parent = node;
+    right->parent = node;
+    right->child[LEFT] = NULL;
+    _update(right);
+    _update(node);
+    tree->size++;                                                       // Tree size
+    tree->root = node;
+    _notify(tree, EDIT_REPLACE, rank, 0, rank, 1);
+}
+
+/* Input: value is a lowercase English letter.
+ * This is a specific method, that doesn't work in general case of a splay tree.
+ * Namely, we first insert entire string and then perform operations on it.
+ * We will never insert a new character in the string again.
+ * Adds a node with letter "value" to the tree, as the new root of the tree.
+ * Returns nothing. */
+static void insertSpecific(SplayTree *tree, char value) {
+    _touch(tree);
+    Node *node = createNode(value);
+    if (tree->root)
+        tree->root->parent = node;
+    node->child[LEFT] = tree->root;
+    _update(node);
+    tree->root = node;
+    if (tree->size < tree->editedFrom)
+        tree->editedFrom = tree->size;
+    tree->size++;
+}
+
+/* *** Streaming builder *** */
+
+/* RopeBuilder builds a balanced tree out of a stream of characters, in O(n) time, keeping only O(log n)
+ * partially built subtrees on a stack.
+ * Every stack entry is a perfect subtree of some height together with the node that will become its parent,
+ * and which is waiting for its right subtree (of the same height) to be completed. Heights strictly decrease towards
+ * the top of the stack. The top entry may still be waiting for its parent node, which is then the next character.
+ * It works like incrementing a binary counter: a completed subtree is combined with entries of the same height.
+ * Equal consecutive characters are collected into a pending run first, and every run becomes one node. */
+
+#define BUILDER_MAX_DEPTH 64                                    // heights are at most 33 for 32-bit sizes
+
+typedef struct RopeBuilder RopeBuilder;
+
+/* RopeBuilder "class" */
+struct RopeBuilder {
+    struct {
+        Node *left;                                             // perfect subtree
+        Node *root;                                             // its parent-to-be; NULL if not read yet
+        unsigned height;
+    } stack[BUILDER_MAX_DEPTH];
+    unsigned depth;
+    unsigned size;
+    char runValue;                                              // the pending run, which isn't a node yet
+    unsigned runCount;
+    unsigned runAttribute;
+};
+
+/* "constructor" for the RopeBuilder "class" */
+static RopeBuilder *createBuilder(void) {
+    RopeBuilder *builder = malloc(sizeof(RopeBuilder));
+    builder->depth = 0;
+    builder->size = 0;
+    builder->runCount = 0;
+    return builder;
+}
+
+/* Turns the pending run into a node, and pushes it on the stack. */
+static void _builderPushRun(RopeBuilder *builder) {
+    if (!builder->runCount)
+        return;
+    Node *node = createNode(builder->runValue);
+    unsigned depth = builder->depth;
+    node->attribute = builder->runAttribute;
+    node->styled = node->attribute != 0;
+    if (builder->runCount > 1) {
+        node->count = builder->runCount;
+        _update(node);
+    }
+    builder->runCount = 0;
+    if (depth && !builder->stack[depth - 1].root) {
+        builder->stack[depth - 1].root = node;
+        return;
+    }
+    unsigned height = 1;
+    while (depth && builder->stack[depth - 1].height == height) {
+        depth--;
+        Node *root = builder->stack[depth].root;
+        root->child[LEFT] = builder->stack[depth].left;
+        root->child[LEFT]->parent = root;
+        root->child[RIGHT] = node;
+        node->parent = root;
+        _update(root);
+        node = root;
+        height++;
+    }
+    builder->stack[depth].left = node;
+    builder->stack[depth].root = NULL;
+    builder->stack[depth].height = height;
+    builder->depth = depth + 1;
+}
+
+/* Appends count copies of the character value, with the given attribute, to the builder. */
+static inline void _builderAppendRun(RopeBuilder *builder, char value, unsigned count, unsigned attribute) {
+    builder->size += count;
+    if (builder->runCount && builder->runValue == value && builder->runAttribute == attribute) {
+        builder->runCount += count;
+        return;
+    }
+    _builderPushRun(builder);
+    builder->runValue = value;
+    builder->runCount = count;
+    builder->runAttribute = attribute;
+}
+
+/* Appends len characters from buf to the builder. */
+static void builderAppend(RopeBuilder *builder, const char *buf, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        size_t end = i + 1;
+        while (end < len && buf[end] == buf[i])
+            end++;
+        _builderAppendRun(builder, buf[i], (unsigned)(end - i), 0);
+        i = end;
+    }
+}
+
+/* Joins the subtrees on the stack into one tree, and returns it.
+ * The builder is destroyed. The depth of the tree is at most about 2 log(n). */
+static SplayTree *builderFinish(RopeBuilder *builder) {
+    Node *result = NULL;
+    _builderPushRun(builder);
+    while (builder->depth) {
+        builder->depth--;
+        Node *left = builder->stack[builder->depth].left;
+        Node *root = builder->stack[builder->depth].root;
+        if (!root) {                                            // can only be the top entry
+            result = left;
+            continue;
+        }
+        root->child[LEFT] = left;
+        left->parent = root;
+        root->child[RIGHT] = result;
+        if (result)
+            result->parent = root;
+        _update(root);
+        result = root;
+    }
+    SplayTree *tree = createTree();
+    tree->root = result;
+    tree->size = builder->size;
+    free(builder);
+    return tree;
+}
+
+/* *** Anchors *** */
+
+/* An anchor points to the node of its character, so split() and merge() carry it along with the character for free.
+ * To keep nodes small, the anchors aren't stored in them: all anchors of all trees are kept in one process-wide
+ * hash table, keyed by their node. A node only has two flags: hasAnchors, and anchored, which tells whether some node
+ * of its subtree has anchors, so that the anchors inside a cut-out piece are found by visiting only the paths that
+ * lead to them. Anchors at the end of a string have no node; they are kept in a list in their tree (tree->anchors).
+ * Like the node allocator, the table isn't synchronized. */
+
+static Anchor **anchorTable = NULL;
+static unsigned anchorBits = 0, anchorCount = 0;                // the table has 2 ^ anchorBits buckets
+
+static inline unsigned _anchorBucket(const Node *node) {
+    return (unsigned)((uintptr_t)node / sizeof(Node) * 2654435761u) >> (32 - anchorBits);
+}
+
+/* Puts the anchor into the bucket of its node. */
+static inline void _linkAnchor(Anchor *anchor) {
+    Anchor **bucket = &anchorTable[_anchorBucket(anchor->node)];
+    anchor->prev = NULL;
+    anchor->next = *bucket;
+    if (*bucket)
+        (*bucket)->prev = anchor;
+    *bucket = anchor;
+}
+
+static inline void _unlinkAnchor(Anchor *anchor) {
+    if (anchor->prev)
+        anchor->prev->next = anchor->next;
+    else
+        anchorTable[_anchorBucket(anchor->node)] = anchor->next;
+    if (anchor->next)
+        anchor->next->prev = anchor->prev;
+}
+
+/* Doubles the number of buckets of the anchor table. */
+static void _growAnchorTable(void) {
+    Anchor **old = anchorTable;
+    unsigned buckets = anchorBits ? 1u << anchorBits : 0;
+    anchorBits = anchorBits ? anchorBits + 1 : 8;
+    anchorTable = calloc((size_t)1 << anchorBits, sizeof(*anchorTable));
+    for (unsigned b = 0; b < buckets; b++)
+        while (old[b]) {
+            Anchor *anchor = old[b];
+            old[b] = anchor->next;
+            _linkAnchor(anchor);
+        }
+    free(old);
+}
+
+/* Frees the table together with the last anchor. */
+static void _releaseAnchor(Anchor *anchor) {
+    free(anchor);
+    if (--anchorCount)
+        return;
+    free(anchorTable);
+    anchorTable = NULL;
+    anchorBits = 0;
+}
+
+/* Takes all the anchors of the node out of the table, and prepends them to the list, which is linked by next. */
+static Anchor *_takeAnchors(Node *node, Anchor *list) {
+    Anchor *anchor = anchorTable[_anchorBucket(node)];
+    while (anchor) {
+        Anchor *next = anchor->next;
+        if (anchor->node == node) {
+            _unlinkAnchor(anchor);
+            anchor->next = list;
+            list = anchor;
+        }
+        anchor = next;
+    }
+    node->hasAnchors = FALSE;
+    return list;
+}
+
+static void _dropAnchors(Node *node) {
+    Anchor *list = _takeAnchors(node, NULL);
+    while (list) {
+        Anchor *next = list->next;
+        _releaseAnchor(list);
+        list = next;
+    }
+}
+
+/* Adds the anchors of the list, which is linked by next, to the end of the string of the tree. */
+static void _addEndAnchors(SplayTree *tree, Anchor *list) {
+    while (list) {
+        Anchor *next = list->next;
+        list->node = NULL;
+        list->prev = NULL;
+        list->next = tree->anchors;
+        if (tree->anchors)
+            tree->anchors->prev = list;
+        tree->anchors = list;
+        list = next;
+    }
+}
+
+/* Moves the anchors of the list, which is linked by next, to the first character of the tree,
+ * or to its end if the tree is empty. Doesn't splay any node. */
+static void _attachAnchors(SplayTree *tree, Anchor *list) {
+    if (!list)
+        return;
+    _touch(tree);
+    Node *node = tree->root;
+    if (!node) {
+        _addEndAnchors(tree, list);
+        return;
+    }
+    while (node->child[LEFT] || node->packed)
+        node = node->packed ? _unpackSegment(tree, node) : node->child[LEFT];
+    node->hasAnchors = TRUE;
+    for (Node *up = node; up; up = up->parent)                  // all nodes on the way contain the first one
+        up->anchored = TRUE;
+    while (list) {
+        Anchor *next = list->next;
+        list->node = node;
+        _linkAnchor(list);
+        list = next;
+    }
+}
+
+/* Takes the end anchors off the tree, e.g. while the tree is cut into pieces and joined again, so that they
+ * can be put back at the end of the result. */
+static inline Anchor *_takeEndAnchors(SplayTree *tree) {
+    Anchor *list = tree->anchors;
+    tree->anchors = NULL;
+    return list;
+}
+
+/* Moves the string and the end anchors of tree "from" into tree "to", which has to be empty. "from" is left empty. */
+static void _moveInto(SplayTree *to, SplayTree *from) {
+    to->root = from->root;
+    to->size = from->size;
+    from->root = NULL;
+    from->size = 0;
+    _addEndAnchors(to, _takeEndAnchors(from));
+}
+
+/* Creates an anchor at the given rank (0 <= rank <= size of the whole tree; rank == size anchors the end of the string).
+ * The anchor belongs to the tree that holds its character, and is destroyed together with it. */
+static Anchor *createAnchor(SplayTree *tree, unsigned rank) {
+    Anchor *anchor = malloc(sizeof(Anchor));
+    if (anchorCount >= (anchorBits ? 1u << anchorBits : 0))
+        _growAnchorTable();
+    anchorCount++;
+    anchor->next = NULL;
+    if (rank >= tree->size) {
+        _addEndAnchors(tree, anchor);
+        return anchor;
+    }
+    Node *node = _isolate(tree, rank);                          // anchors point to the start of a node, which is the root now
+    node->hasAnchors = TRUE;
+    node->anchored = TRUE;
+    anchor->node = node;
+    _linkAnchor(anchor);
+    return anchor;
+}
+
+/* "destructor" for the Anchor "class"
+ * Input: the tree that holds the anchor; the anchor. */
+static void destroyAnchor(SplayTree *tree, Anchor *anchor) {
+    Node *node = anchor->node;
+    if (!node) {
+        if (anchor->prev)
+            anchor->prev->next = anchor->next;
+        else
+            tree->anchors = anchor->next;
+        if (anchor->next)
+            anchor->next->prev = anchor->prev;
+        _releaseAnchor(anchor);
+        return;
+    }
+    _unlinkAnchor(anchor);
+    _releaseAnchor(anchor);
+    for (Anchor *other = anchorTable ? anchorTable[_anchorBucket(node)] : NULL; other; other = other->next)
+        if (other->node == node)
+            return;                                             // the node still has anchors
+    node->hasAnchors = FALSE;
+    for (; node; node = node->parent) {                         // clears the flag up to the first subtree with other anchors
+        Node *left = node->child[LEFT], *right = node->child[RIGHT];
+        char anchored = node->hasAnchors || (left && left->anchored) || (right && right->anchored);
+        if (anchored == node->anchored)
+            break;
+        node->anchored = anchored;
+    }
+}
+
+/* Returns the current rank of the anchored character, in the tree that holds it.
+ * Splays its node to the root, so the rank is simply the size of the left subtree. O(log n) amortized. */
+static unsigned anchorPosition(SplayTree *tree, Anchor *anchor) {
+    if (!anchor->node)
+        return tree->size;
+    _splay(tree, anchor->node);
+    return anchor->node->child[LEFT] ? anchor->node->child[LEFT]->size : 0;
+}
+
+/* Has to be called before the nodes of the tree "dropped" are freed, where "dropped" has been cut out of a string.
+ * Moves the anchors that point into "dropped" to the first character of "next", which is the piece that followed
+ * the dropped one, or to the end of "next" if it's empty.
+ * Only visits the nodes on the paths to the anchored nodes of "dropped", so it costs nothing if there are none. */
+static void _moveAnchors(SplayTree *dropped, SplayTree *next) {
+    Node *root = dropped->root;
+    if (!root || !root->anchored)
+        return;
+    unsigned capacity = 64, depth = 0;
+    Node **stack = malloc(capacity * sizeof(*stack));
+    Anchor *list = NULL;
+    stack[depth++] = root;
+    while (depth) {
+        Node *node = stack[--depth];
+        if (node->hasAnchors)
+            list = _takeAnchors(node, list);
+        node->anchored = FALSE;
+        for (int dir = LEFT; dir <= RIGHT; dir++)
+            if (node->child[dir] && node->child[dir]->anchored) {
+                if (depth == capacity) {
+                    capacity *= 2;
+                    stack = realloc(stack, capacity * sizeof(*stack));
+                }
+                stack[depth++] = node->child[dir];
+            }
+    }
+    free(stack);
+    _attachAnchors(next, list);
+}
+
+/* Input: pointer to a tree; pointer to a Node object in the tree.
+ * Returns a pointer to a node object with maximum key value in the subtree rooted at node.
+ * Splays the found node to the top of the tree. */
+static Node *subtreeMaximum(SplayTree *tree, Node *node) {
+    if (!node)
+        return NULL;
+    while (node->child[RIGHT] || node->packed)
+        node = node->packed ? _unpackSegment(tree, node) : node->child[RIGHT];
+    _splay(tree, node);
+    return node;
+}
+
+
+
+/* Merges two Splay trees, tree1 and tree2, using the last element (of highest rank) in tree1 (left string) as the node for merging, into a new Splay tree.
+ * CONSTRAINTS: None.
+ * INPUT: pointers to tree1 and tree2.
+ * OUTPUT (the return value of this function) is pointer to tree1, with all the elements of both trees.
+ * USAGE: After this function, we can delete tree2, which is left empty.
+ * The end anchors of tree1 move to the first character of tree2, and those of tree2 to the end of the result. */
+static SplayTree *merge(SplayTree *tree1, SplayTree *tree2) {
+    if (tree1)
+        _touch(tree1);
+    if (tree2)
+        _touch(tree2);
+    if (!tree1 || !tree1->root) {
+        if (tree1 && tree2 && tree1 != tree2)
+            _attachAnchors(tree2, _takeEndAnchors(tree1));
+        return tree2;
+    }
+    if (!tree2 || !tree2->root) {
+        if (tree2 && tree1 != tree2)
+            _addEndAnchors(tree1, _takeEndAnchors(tree2));
+        return tree1;
+    }
+    _attachAnchors(tree2, _takeEndAnchors(tree1));
+    _addEndAnchors(tree1, _takeEndAnchors(tree2));
+    Node *root2 = tree2->root;
+    Node *root1 = subtreeMaximum(tree1, tree1->root);
+    root2->parent = root1;
+    root1->child[RIGHT] = root2;
+    _update(root1);
+    tree1->size = root1->size;
+    tree2->root = NULL;
+    tree2->size = 0;
+    return tree1;
+}
+
+/* Merges two trees with merge(), and frees the one which ended up empty.
+ * Returns a pointer to the tree with all the elements. */
+static SplayTree *_join(SplayTree *tree1, SplayTree *tree2) {
+    SplayTree *result = merge(tree1, tree2);
+    if (tree1 && tree1 != result)
+        destroyTree(tree1);
+    if (tree2 && tree2 != result)
+        destroyTree(tree2);
+    return result;
+}
+
+/*  Splits Splay tree into two trees.
+ * Input: pointer to a Splay tree; rank of a node (counting starts from 0; 0 <= rank < size of the whole tree);
+ *     two pointers to SplayTree pointers, by which the new Splay trees are returned (in-out).
+ * Output: Two Splay trees, one with elements with rank <= "rank", the other with elements with rank > "rank",
+ *     fetched by the last two arguments to the function. The input tree is left empty.
+ *     The anchors of the characters go with them, and the end anchors of the input tree go to the second tree.
+ * There is no return value. */
+static void split(SplayTree *tree, unsigned rank, SplayTree **tree1, SplayTree **tree2) {
+    Node *root1 = orderStatisticZeroBasedRanking(tree, rank);
+    unsigned end = (root1->child[LEFT] ? root1->child[LEFT]->size : 0) + root1->count - 1;
+    if (rank < end) {                                           // the run goes on after rank: its rest starts the right part
+        Node *tail = createNode(root1->value);
+        tail->attribute = root1->attribute;
+        tail->count = end - rank;
+        root1->count -= tail->count;
+        tail->child[RIGHT] = root1->child[RIGHT];
+        if (tail->child[RIGHT])
+            tail->child[RIGHT]->parent = tail;
+        _update(tail);
+        root1->child[RIGHT] = tail;
+    }
+    Node *root2 = root1->child[RIGHT];
+    root1->child[RIGHT] = NULL;
+    _update(root1);
+    *tree1 = createTree();
+    (*tree1)->root = root1;                                     // insertTree()
+    (*tree1)->size = root1->size;
+    *tree2 = createTree();
+    if (root2) {
+        root2->parent = NULL;
+        (*tree2)->root = root2;                                 // insertTree()
+        (*tree2)->size = root2->size;
+    }
+    (*tree2)->anchors = _takeEndAnchors(tree);
+    tree->root = NULL;
+    tree->size = 0;
+    return;
+}
+
+/* Builds a tree out of pieces[lo..hi], using separators[lo..hi-1] as the nodes between them, and returns its root.
+ * The separators form a perfectly balanced tree on top of the pieces. */
+static Node *_concatPieces(Node **pieces, Node **separators, unsigned lo, unsigned hi) {
+    if (lo == hi)
+        return pieces[lo];
+    unsigned mid = lo + (hi - lo) / 2;
+    Node *root = separators[mid];
+    root->child[LEFT] = _concatPieces(pieces, separators, lo, mid);
+    root->child[RIGHT] = _concatPieces(pieces, separators, mid + 1, hi);
+    if (root->child[LEFT])
+        root->child[LEFT]->parent = root;
+    if (root->child[RIGHT])
+        root->child[RIGHT]->parent = root;
+    _update(root);
+    return root;
+}
+
+/* Concatenates k Splay trees, in the given order.
+ * The last node of every tree but the last one is splayed to its root and detached, and these nodes are used to
+ * join the remaining pieces in a perfectly balanced way. So, it takes k splays in total, and the depth of the result
+ * is only log(k) larger than the depth of the deepest input tree.
+ * INPUT: array of k pointers to trees.
+ * OUTPUT (the return value of this function) is the first nonempty input tree, with all the elements of all trees,
+ *     or the first input tree if they are all empty.
+ * USAGE: After this function, we can delete the other trees, which are left empty. As in merge(), the end anchors
+ *     of every tree move to the first character of the next nonempty tree, or to the end of the result. */
+static SplayTree *concatMany(SplayTree **trees, unsigned k) {
+    Node **pieces = malloc(k * sizeof(*pieces));
+    Node **separators = malloc(k * sizeof(*separators));
+    SplayTree *result = NULL, *first = NULL;
+    Anchor *pending = NULL;                                     // end anchors of the trees since the last nonempty one
+    unsigned count = 0, size = 0;
+    for (unsigned i = 0; i < k; i++) {
+        if (!trees[i])
+            continue;
+        _touch(trees[i]);
+        if (!first)
+            first = trees[i];
+        if (trees[i]->root) {
+            _attachAnchors(trees[i], pending);
+            pending = NULL;
+        }
+        while (trees[i]->anchors) {
+            Anchor *anchor = trees[i]->anchors;
+            trees[i]->anchors = anchor->next;
+            anchor->next = pending;
+            pending = anchor;
+        }
+        if (!trees[i]->root)
+            continue;
+        if (!result)
+            result = trees[i];
+        pieces[count++] = trees[i]->root;
+        size += trees[i]->size;
+        trees[i]->root = NULL;
+        trees[i]->size = 0;
+    }
+    if (!result) {
+        free(pieces);
+        free(separators);
+        if (first)
+            _addEndAnchors(first, pending);
+        return first;
+    }
+    for (unsigned i = 0; i + 1 < count; i++) {
+        SplayTree piece = { 0 };                                // only needed to have somewhere to splay to
+        piece.root = pieces[i];
+        Node *last = subtreeMaximum(&piece, piece.root);
+        pieces[i] = last->child[LEFT];
+        if (pieces[i])
+            pieces[i]->parent = NULL;
+        last->child[LEFT] = NULL;
+        separators[i] = last;
+    }
+    result->root = _concatPieces(pieces, separators, 0, count - 1);
+    result->root->parent = NULL;
+    result->size = size;
+    _addEndAnchors(result, pending);
+    free(pieces);
+    free(separators);
+    return result;
+}
+
+/* *** Sliding window *** */
+
+/* LogWindow is a rope used as a sliding window over a stream: text is appended at the end and dropped from the front.
+ * Appended characters are collected in a plain tail buffer, which is turned into a balanced subtree with
+ * RopeBuilder and merged into the tree (one splay) when it fills up, so appending is O(1) amortized.
+ * Dropping a prefix splits it off, and its nodes are freed a few at a time during the following operations,
+ * instead of all at once with postOrderFree(). Freeing two nodes per appended character keeps up with a window
+ * that drops text as fast as it appends it. */
+
+#define WINDOW_TAIL_CAPACITY 4096
+#define WINDOW_FREE_BUDGET 64                                   // nodes freed per operation, plus two per appended character
+
+typedef struct LogWindow LogWindow;
+
+/* LogWindow "class" */
+struct LogWindow {
+    SplayTree *tree;
+    char tail[WINDOW_TAIL_CAPACITY];                            // appended characters that aren't in the tree yet
+    unsigned tailSize;
+    Node **graveyard;                                           // stack of dropped nodes whose subtrees are still to be freed
+    unsigned graveSize, graveCapacity;
+};
+
+/* "constructor" for the LogWindow "class"
+ * Creates an empty window. */
+static LogWindow *createWindow(void) {
+    LogWindow *window = malloc(sizeof(LogWindow));
+    window->tree = createTree();
+    window->tailSize = 0;
+    window->graveCapacity = 64;
+    window->graveSize = 0;
+    window->graveyard = malloc(window->graveCapacity * sizeof(*window->graveyard));
+    return window;
+}
+
+static inline void _bury(LogWindow *window, Node *node) {
+    if (window->graveSize == window->graveCapacity) {
+        window->graveCapacity *= 2;
+        window->graveyard = realloc(window->graveyard, window->graveCapacity * sizeof(*window->graveyard));
+    }
+    window->graveyard[window->graveSize++] = node;
+}
+
+/* Frees at most budget dropped nodes. */
+static void _freeSome(LogWindow *window, unsigned budget) {
+    while (budget-- && window->graveSize) {
+        Node *node = window->graveyard[--window->graveSize];
+        if (node->child[LEFT])
+            _bury(window, node->child[LEFT]);
+        if (node->child[RIGHT])
+            _bury(window, node->child[RIGHT]);
+        if (node->hasAnchors)
+            _dropAnchors(node);
+        if (node->packed)
+            _dropSegment(node);
+        destroyNode(node);
+    }
+}
+
+/* Moves the tail buffer into the tree. */
+static void _flushTail(LogWindow *window) {
+    if (!window->tailSize)
+        return;
+    RopeBuilder *builder = createBuilder();
+    builderAppend(builder, window->tail, window->tailSize);
+    SplayTree *tail = builderFinish(builder);
+    Anchor *ends = _takeEndAnchors(window->tree);               // appending doesn't move the end of the string
+    merge(window->tree, tail);
+    if (!window->tree->root)                                    // merge() returns tail if the tree is empty
+        _moveInto(window->tree, tail);
+    _addEndAnchors(window->tree, ends);
+    destroyTree(tail);
+    window->tailSize = 0;
+}
+
+/* "destructor" for the LogWindow "class" */
+static void destroyWindow(LogWindow *window) {
+    if (!window)
+        return;
+    _freeSome(window, (unsigned)-1);
+    destroyTree(window->tree);
+    free(window->graveyard);
+    free(window);
+}
+
+/* Returns the number of characters in the window. */
+static inline unsigned windowSize(LogWindow *window) {
+    return window->tree->size + window->tailSize;
+}
+
+/* Appends len characters from buf at the end of the window. */
+static void windowAppend(LogWindow *window, const char *buf, size_t len) {
+    unsigned budget = WINDOW_FREE_BUDGET + 2 * (unsigned)len;
+    while (len) {
+        size_t chunk = WINDOW_TAIL_CAPACITY - window->tailSize;
+        if (chunk > len)
+            chunk = len;
+        memcpy(window->tail + window->tailSize, buf, chunk);
+        window->tailSize += (unsigned)chunk;
+        buf += chunk;
+        len -= chunk;
+        if (window->tailSize == WINDOW_TAIL_CAPACITY)
+            _flushTail(window);
+    }
+    _freeSome(window, budget);
+}
+
+/* Drops the first n characters of the window (n <= size of the window).
+ * The dropped nodes are freed incrementally by the following operations. */
+static void windowDropPrefix(LogWindow *window, unsigned n) {
+    if (!n)
+        return;
+    if (n >= window->tree->size)                                // the anchors of the dropped text move into the tail
+        _flushTail(window);
+    SplayTree *dropped, *rest;
+    split(window->tree, n - 1, &dropped, &rest);
+    _moveAnchors(dropped, rest);
+    _bury(window, dropped->root);
+    dropped->root = NULL;
+    destroyTree(dropped);
+    _moveInto(window->tree, rest);
+    free(rest);
+    _freeSome(window, WINDOW_FREE_BUDGET);
+}
+
+/* Returns the character at the given rank (0 <= rank < size of the window). */
+static char windowCharAt(LogWindow *window, unsigned rank) {
+    if (rank >= window->tree->size)
+        return window->tail[rank - window->tree->size];
+    return orderStatisticZeroBasedRanking(window->tree, rank)->value;
+}
+
+/* Splits Splay tree into k + 1 trees.
+ * Input: pointer to a Splay tree; strictly increasing array of k ranks (0 <= rank < size of the whole tree);
+ *     array of k + 1 SplayTree pointers, by which the new trees are returned.
+ * Output: pieces[0] gets the elements with rank <= ranks[0], pieces[i] the elements with ranks[i - 1] < rank <= ranks[i],
+ *     and pieces[k] the elements with rank > ranks[k - 1] (it may be empty). The input tree is left empty;
+ *     as with split(), the anchors go with their characters, and the end anchors to pieces[k].
+ * Every split is done on the remainder of the tree, whose root is the previous split point, so
+ * consecutive ranks that are close to each other are cheap. */
+static void splitMany(SplayTree *tree, const unsigned *ranks, unsigned k, SplayTree **pieces) {
+    SplayTree *rest = tree;
+    unsigned offset = 0;
+    for (unsigned i = 0; i < k; i++) {
+        SplayTree *remainder;
+        split(rest, ranks[i] - offset, &pieces[i], &remainder);
+        if (rest != tree)
+            destroyTree(rest);
+        rest = remainder;
+        offset = ranks[i] + 1;
+    }
+    if (rest == tree) {
+        pieces[k] = createTree();
+        _touch(tree);
+        _moveInto(pieces[k], tree);
+    }
+    else
+        pieces[k] = rest;
+}
+
+/* This is cut-and-paste function.
+ * For i and j, counting starts from 0; for k, counting starts from 1.
+ * We paste the substring after the k - th symbol of the remaining string(after cutting).
+ * If k == 0, we insert the substring at the beginning. */
+/* We can't destroy left, middle and right at the end of the function,
+ * because merge() doesn't create a new tree.
+ * Function merge() returns a pointer to a tree, which means that its two parts
+ * are preserved. It just merges them together.
+ * Globally, we don't change the size of the tree in this function.
+ * We just split it and then merge it back.
+ * The temporary trees are freed as soon as they become empty, and the result is moved back
+ * into the original tree object, so *tree keeps pointing to the same object (and its cache, if any). */
+void process(SplayTree **tree, unsigned i, unsigned j, unsigned k) {
+    /* If these three pointers are declared static, it's very slow. */
+    SplayTree *left = NULL, *middle = NULL, *right = NULL, *rest;
+    SplayTree *whole = *tree;
+    Anchor *ends = _takeEndAnchors(whole);                      // the end of the string stays the end
+    split(whole, j, &middle, &right);
+    if (i > 0) {
+        rest = middle;
+        split(rest, i - 1, &left, &middle);
+        destroyTree(rest);
+    }
+    left = _join(left, right);
+    if (k > 0) {
+        rest = left;
+        split(rest, k - 1, &left, &right);
+        destroyTree(rest);
+    }
+    else {
+        right = left;
+        left = NULL;
+    }
+    rest = _join(_join(left, middle), right);
+    whole->root = rest->root;
+    whole->size = rest->size;
+    whole->anchors = ends;
+    free(rest);
+    _notify(whole, EDIT_MOVE, i, j - i + 1, k, j - i + 1);
+    return;
+}
+
+
+/* Cyclically rotates the string to the left by shift positions: the first shift characters move to the end.
+ * Takes one split and one merge, that is, two splays.
+ * Like process(), keeps *tree pointing to the same object. */
+void rotate(SplayTree **tree, unsigned shift) {
+    SplayTree *whole = *tree, *head, *rest;
+    if (!whole->size || !(shift %= whole->size))
+        return;
+    Anchor *ends = _takeEndAnchors(whole);
+    split(whole, shift - 1, &head, &rest);
+    rest = _join(rest, head);
+    whole->root = rest->root;
+    whole->size = rest->size;
+    whole->anchors = ends;
+    free(rest);
+    _notify(whole, EDIT_MOVE, 0, shift, whole->size - shift, shift);
+}
+
+/* Swaps the substrings S[i1..j1] and S[i2..j2]. Counting starts from 0.
+ * Constraints: 0 <= i1 <= j1 < i2 <= j2 <= n - 1.
+ * The string is cut into at most five pieces with splitMany() (at most four splays), and they are joined back
+ * in the new order with concatMany() (at most four more splays).
+ * Like process(), keeps *tree pointing to the same object. */
+void swapRanges(SplayTree **tree, unsigned i1, unsigned j1, unsigned i2, unsigned j2) {
+    SplayTree *whole = *tree;
+#ifdef DEBUG
+    if (i1 > j1 || j1 >= i2 || i2 > j2 || j2 >= whole->size) {
+        printf("0 <= i1 <= j1 < i2 <= j2 <= n - 1\n");
+        exit(-1);
+    }
+#endif // DEBUG
+    /* Pieces: 0 = S[0..i1-1], 1 = S[i1..j1], 2 = S[j1+1..i2-1], 3 = S[i2..j2], 4 = S[j2+1..n-1]. Some may be empty. */
+    unsigned last[4] = { i1 - 1, j1, i2 - 1, j2 };
+    char exists[4] = { i1 > 0, TRUE, i2 > j1 + 1, TRUE };
+    static const unsigned order[5] = { 0, 3, 2, 1, 4 };
+    SplayTree *pieces[5] = { NULL }, *parts[5], *ordered[5];
+    unsigned ranks[4], k = 0;
+    for (unsigned p = 0; p < 4; p++)
+        if (exists[p])
+            ranks[k++] = last[p];
+    Anchor *ends = _takeEndAnchors(whole);
+    splitMany(whole, ranks, k, parts);
+    k = 0;
+    for (unsigned p = 0; p < 4; p++)
+        if (exists[p])
+            pieces[p] = parts[k++];
+    pieces[4] = parts[k];
+    for (unsigned p = 0; p < 5; p++)
+        ordered[p] = pieces[order[p]];
+    SplayTree *result = concatMany(ordered, 5);
+    _moveInto(whole, result);
+    _addEndAnchors(whole, ends);
+    for (unsigned p = 0; p < 5; p++)
+        destroyTree(pieces[p]);
+    _notify(whole, EDIT_REPLACE, i1, j2 - i1 + 1, i1, j2 - i1 + 1);
+}
+
+/* Replaces count characters starting at rank i with len characters from s (0 <= i <= i + count <= size of the whole tree).
+ * With count == 0 it inserts a string, and with len == 0 it deletes a substring.
+ * The new characters are built into a balanced subtree with RopeBuilder, and the string is cut and joined back
+ * with splitMany() and concatMany(), so it's a single bulk operation however long the strings are.
+ * The deleted nodes are freed, and their anchors move to the character which follows the new text. */
+static void splice(SplayTree *tree, unsigned i, unsigned count, const char *s, unsigned len) {
+    SplayTree *parts[3], *pieces[3];
+    unsigned ranks[2] = { 0 }, k = 0;
+    if (i > 0)
+        ranks[k++] = i - 1;
+    if (count)
+        ranks[k++] = i + count - 1;
+    Anchor *ends = _takeEndAnchors(tree);
+    splitMany(tree, ranks, k, parts);
+    RopeBuilder *builder = createBuilder();
+    builderAppend(builder, s, len);
+    pieces[0] = i > 0 ? parts[0] : NULL;
+    pieces[1] = builderFinish(builder);
+    pieces[2] = parts[k];
+    if (count) {
+        _moveAnchors(parts[k - 1], parts[k]);
+        destroyTree(parts[k - 1]);
+    }
+    SplayTree *result = concatMany(pieces, 3);
+    _moveInto(tree, result);
+    _addEndAnchors(tree, ends);
+    for (unsigned p = 0; p < 3; p++)
+        destroyTree(pieces[p]);
+    _notify(tree, EDIT_REPLACE, i, count, i, len);
+}
+
+/* Deletes the substring S[i..j] (0 <= i <= j <= n - 1). */
+static void erase(SplayTree *tree, unsigned i, unsigned j) {
+    splice(tree, i, j - i + 1, NULL, 0);
+}
+
+typedef struct Edit Edit;
+
+/* Edit "class": replace count characters starting at rank pos with len characters from text. */
+struct Edit {
+    unsigned pos;
+    unsigned count;
+    const char *text;
+    unsigned len;
+};
+
+/* Applies n edits to the tree at once, e.g. the same edit made with several cursors.
+ * The edits have to be sorted by pos and must not overlap (edits[e].pos + edits[e].count <= edits[e + 1].pos);
+ * all positions refer to the string before any of the edits, so the caller doesn't have to adjust them.
+ * The tree is cut at all edit boundaries in one left-to-right splitMany(), and the kept pieces and the new texts
+ * are joined in one concatMany(), so that there are O(n) splays in total, instead of n separate splices. */
+static void applyEdits(SplayTree *tree, const Edit *edits, unsigned n) {
+    unsigned *ranks = calloc(2 * n + 1, sizeof(*ranks));        // zeroed, so that gcc doesn't warn when k == 0
+    SplayTree **parts = malloc((2 * n + 1) * sizeof(*parts));
+    SplayTree **pieces = malloc((2 * n + 1) * sizeof(*pieces));
+    unsigned k = 0, next = 0;                                   // next is the first rank that isn't cut off yet
+    for (unsigned e = 0; e < n; e++) {
+#ifdef DEBUG
+        if (edits[e].pos < next || edits[e].pos + edits[e].count > tree->size) {
+            printf("Edits must be sorted, must not overlap, and must fit in the string\n");
+            exit(-1);
+        }
+#endif // DEBUG
+        if (edits[e].pos > next)
+            ranks[k++] = edits[e].pos - 1;                      // kept piece
+        if (edits[e].count)
+            ranks[k++] = edits[e].pos + edits[e].count - 1;     // replaced piece
+        next = edits[e].pos + edits[e].count;
+    }
+    Anchor *ends = _takeEndAnchors(tree);
+    splitMany(tree, ranks, k, parts);
+    unsigned p = 0, m = 0;
+    next = 0;
+    for (unsigned e = 0; e < n; e++) {
+        if (edits[e].pos > next)
+            pieces[m++] = parts[p++];
+        if (edits[e].count) {
+            _moveAnchors(parts[p], parts[p + 1]);
+            destroyTree(parts[p++]);
+        }
+        if (edits[e].len) {
+            RopeBuilder *builder = createBuilder();
+            builderAppend(builder, edits[e].text, edits[e].len);
+            pieces[m++] = builderFinish(builder);
+        }
+        next = edits[e].pos + edits[e].count;
+    }
+    pieces[m++] = parts[p];
+    SplayTree *result = concatMany(pieces, m);
+    _moveInto(tree, result);
+    _addEndAnchors(tree, ends);
+    for (unsigned q = 0; q < m; q++)
+        destroyTree(pieces[q]);
+    free(ranks);
+    free(parts);
+    free(pieces);
+    long shift = 0;                                             // the events apply one after another
+    for (unsigned e = 0; e < n; e++) {                          // even without an observer, for tree->editedFrom
+        unsigned start = (unsigned)(edits[e].pos + shift);
+        _notify(tree, EDIT_REPLACE, start, edits[e].count, start, edits[e].len);
+        shift += (long)edits[e].len - (long)edits[e].count;
+    }
+}
+
+/* *** Attributes *** */
+
+/* Every node has an attribute, e.g. an index into the caller's table of styles; 0 means no attribute.
+ * The attributes are part of the nodes, so process() and the other operations that rearrange the text move them
+ * together with their characters for free, and don't have to rebase any spans.
+ * New text gets no attribute. Packing a tree would lose the attributes, so trees with attributes stay in memory. */
+
+/* Visitor callback, see visitSpans(). */
+typedef void (*SpanVisitor)(void *context, unsigned start, unsigned length, unsigned attribute);
+
+/* Sets the attribute of the substring S[i..j] (0 <= i <= j <= n - 1); 0 removes it.
+ * The range is cut out with splitMany(), which also cuts the runs at its ends, all its nodes get the attribute,
+ * and the pieces are joined back with concatMany(). O(log n + number of nodes in the range).
+ * The text doesn't change, so the observer isn't called. */
+static void setAttribute(SplayTree *tree, unsigned i, unsigned j, unsigned attribute) {
+    SplayTree *parts[3];
+    unsigned ranks[2] = { 0 }, k = 0;
+    if (i > 0)
+        ranks[k++] = i - 1;
+    ranks[k++] = j;
+    Anchor *ends = _takeEndAnchors(tree);
+    splitMany(tree, ranks, k, parts);
+    SplayTree *range = parts[k - 1];
+    Node **stack = malloc(range->size * sizeof(*stack));
+    size_t stackIndex = 0;
+    stack[stackIndex++] = range->root;
+    while (stackIndex) {                                        // all nodes get the same attribute, so the order doesn't matter
+        Node *node = stack[--stackIndex];
+        if (node->packed)
+            node = _unpackSegment(range, node);
+        node->attribute = attribute;
+        node->styled = attribute != 0;
+        for (int dir = LEFT; dir <= RIGHT; dir++)
+            if (node->child[dir])
+                stack[stackIndex++] = node->child[dir];
+    }
+    free(stack);
+    SplayTree *result = concatMany(parts, k + 1);
+    _moveInto(tree, result);
+    _addEndAnchors(tree, ends);
+    for (unsigned p = 0; p <= k; p++)
+        destroyTree(parts[p]);
+}
+
+/* Returns the attribute of the character with the given rank (0 <= rank < size of the whole tree). */
+static unsigned attributeAt(SplayTree *tree, unsigned rank) {
+    return orderStatisticZeroBasedRanking(tree, rank)->attribute;
+}
+
+/* Calls the visitor for every maximal span of equal attributes in S[i..i+len-1] (0 <= i <= i + len <= size of the whole tree),
+ * from left to right, with the span's rank, length and attribute.
+ * Works like substring(), but skips whole subtrees without attributes inside a span without one, so it's
+ * O(log n + number of nodes with attributes in the range). */
+static void visitSpans(SplayTree *tree, unsigned i, unsigned len, SpanVisitor visitor, void *context) {
+    if (!len)
+        return;
+    Node *node = orderStatisticZeroBasedRanking(tree, i);
+    unsigned offset = i - (node->child[LEFT] ? node->child[LEFT]->size : 0);
+    unsigned index = node->count - offset < len ? node->count - offset : len, capacity = 64;
+    unsigned start = i, length = index, attribute = node->attribute;
+    Node **stack = malloc(capacity * sizeof(*stack));
+    size_t stackIndex = 0;
+    node = node->child[RIGHT];
+    while (index < len) {
+        while (node) {
+            if (!node->styled && !attribute && node->size <= len - index) {
+                length += node->size;                           // the whole subtree continues the span
+                index += node->size;
+                node = NULL;
+                break;
+            }
+            if (stackIndex == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(*stack));
+            }
+            stack[stackIndex++] = node;
+            node = node->child[LEFT];
+        }
+        if (index == len)
+            break;
+        node = stack[--stackIndex];
+        if (node->attribute != attribute) {                     // visit()
+            visitor(context, start, length, attribute);
+            start = i + index;
+            length = 0;
+            attribute = node->attribute;
+        }
+        unsigned count = node->count < len - index ? node->count : len - index;
+        length += count;
+        index += count;
+        node = node->child[RIGHT];
+    }
+    visitor(context, start, length, attribute);
+    free(stack);
+}
+
+/* *** Search and replace *** */
+
+/* Returns a new tree with the text of the tree, in which all occurrences of pattern (of length m) are replaced
+ * with replacement (of length len). The occurrences are found from left to right, and don't overlap.
+ * The tree doesn't change, and no node is splayed. With an empty pattern, the result is a copy of the text.
+ * The runs of the tree are streamed in order through a Knuth-Morris-Pratt matcher, and the output goes straight into
+ * a RopeBuilder, so it's a single O(n + m + output) pass, instead of a search and a splice from the root per occurrence.
+ * The characters of a partial match are the pattern's prefix, so only their attributes have to be remembered until
+ * the match fails; a run that can't start a match is copied to the output whole.
+ * Unchanged characters keep their attributes; the replacement gets none. */
+static SplayTree *replaceAll(SplayTree *tree, const char *pattern, unsigned m, const char *replacement, unsigned len) {
+    RopeBuilder *builder = createBuilder();
+    unsigned *fail = malloc((m + 1) * sizeof(*fail));           // fail[q]: length of the longest proper border of pattern[0..q-1]
+    unsigned *attributes = malloc((m + 1) * sizeof(*attributes));   // attributes of the matched characters, a ring from head
+    unsigned q = 0, head = 0;
+    fail[0] = 0;
+    if (m)
+        fail[1] = 0;
+    for (unsigned i = 1, k = 0; i < m; i++) {
+        while (k && pattern[i] != pattern[k])
+            k = fail[k];
+        if (pattern[i] == pattern[k])
+            k++;
+        fail[i + 1] = k;
+    }
+    _touch(tree);
+    Node **stack = malloc((tree->size + 1) * sizeof(*stack));
+    char *segment = malloc(SEGMENT_SIZE);                       // the text of the packed node being visited
+    size_t stackIndex = 0;
+    Node *node = tree->root;
+    while (node || stackIndex) {
+        while (node) {
+            stack[stackIndex++] = node;
+            node = node->child[LEFT];
+        }
+        node = stack[--stackIndex];
+        if (node->packed)                                       // visit(), run by run
+            _segmentText(node, segment);
+        for (unsigned offset = 0; offset < node->count; ) {
+            char c = node->packed ? segment[offset] : node->value;
+            unsigned left = 1;
+            if (!node->packed)
+                left = node->count;
+            else
+                while (offset + left < node->count && segment[offset + left] == c)
+                    left++;
+            offset += left;
+            while (left) {
+                if (m && c == pattern[q]) {
+                    attributes[(head + q) % m] = node->attribute;
+                    left--;
+                    if (++q == m) {
+                        builderAppend(builder, replacement, len);
+                        q = head = 0;
+                    }
+                }
+                else if (q) {                                   // the first q - fail[q] matched characters can't be part of a match
+                    for (unsigned x = 0; x < q - fail[q]; x++)
+                        _builderAppendRun(builder, pattern[x], 1, attributes[(head + x) % m]);
+                    head = (head + q - fail[q]) % m;
+                    q = fail[q];
+                }
+                else {
+                    _builderAppendRun(builder, c, left, node->attribute);
+                    left = 0;
+                }
+            }
+        }
+        node = node->child[RIGHT];
+    }
+    for (unsigned x = 0; x < q; x++)
+        _builderAppendRun(builder, pattern[x], 1, attributes[(head + x) % m]);
+    free(segment);
+    free(stack);
+    free(fail);
+    free(attributes);
+    return builderFinish(builder);
+}
+
+/* *** Coalescing edit buffer *** */
+
+/* EditBuffer sits in front of a tree and collects single-character edits, as issued by typing.
+ * It holds one pending edit: "deleted" characters of the tree starting at rank pos are removed, and the characters
+ * in "inserted" take their place. Consecutive inserts and deletes next to (or inside) the pending edit are merged
+ * into it; any other edit, a full buffer, or editFlush() applies the pending edit to the tree with one splice().
+ * Reads overlay the pending edit on the tree, so they see the current text without flushing. */
+
+#define EDIT_BUFFER_CAPACITY 256
+
+typedef struct EditBuffer EditBuffer;
+
+/* EditBuffer "class" */
+struct EditBuffer {
+    SplayTree *tree;
+    unsigned pos;                                               // rank in the tree where the pending edit starts
+    unsigned deleted;                                           // number of characters of the tree removed at pos
+    char inserted[EDIT_BUFFER_CAPACITY];                        // characters that replace them
+    unsigned insertedSize;
+};
+
+/* "constructor" for the EditBuffer "class"
+ * Input: the tree to be edited. The tree stays owned by the caller. */
+static EditBuffer *createEditBuffer(SplayTree *tree) {
+    EditBuffer *buffer = malloc(sizeof(EditBuffer));
+    buffer->tree = tree;
+    buffer->pos = 0;
+    buffer->deleted = 0;
+    buffer->insertedSize = 0;
+    return buffer;
+}
+
+/* Applies the pending edit to the tree. */
+static void editFlush(EditBuffer *buffer) {
+    if (!buffer->deleted && !buffer->insertedSize)
+        return;
+    splice(buffer->tree, buffer->pos, buffer->deleted, buffer->inserted, buffer->insertedSize);
+    buffer->deleted = 0;
+    buffer->insertedSize = 0;
+}
+
+/* "destructor" for the EditBuffer "class"
+ * Flushes the pending edit; doesn't destroy the tree. */
+static void destroyEditBuffer(EditBuffer *buffer) {
+    if (!buffer)
+        return;
+    editFlush(buffer);
+    free(buffer);
+}
+
+/* Returns the length of the text, with the pending edit applied. */
+static inline unsigned editSize(EditBuffer *buffer) {
+    return buffer->tree->size - buffer->deleted + buffer->insertedSize;
+}
+
+/* Inserts the character value at the given rank of the text (0 <= rank <= editSize()). */
+static void editInsert(EditBuffer *buffer, unsigned rank, char value) {
+    int pending = buffer->deleted || buffer->insertedSize;
+    if (pending && rank >= buffer->pos && rank <= buffer->pos + buffer->insertedSize &&
+        buffer->insertedSize < EDIT_BUFFER_CAPACITY) {
+        char *at = buffer->inserted + (rank - buffer->pos);
+        memmove(at + 1, at, buffer->insertedSize - (rank - buffer->pos));
+        *at = value;
+        buffer->insertedSize++;
+        return;
+    }
+    editFlush(buffer);
+    buffer->pos = rank;
+    buffer->inserted[0] = value;
+    buffer->insertedSize = 1;
+}
+
+/* Deletes the character at the given rank of the text (0 <= rank < editSize()). */
+static void editDelete(EditBuffer *buffer, unsigned rank) {
+    unsigned pos = buffer->pos;
+    int pending = buffer->deleted || buffer->insertedSize;
+    if (pending && rank >= pos && rank < pos + buffer->insertedSize) {
+        char *at = buffer->inserted + (rank - pos);             // deleting a character that hasn't reached the tree yet
+        memmove(at, at + 1, buffer->insertedSize - (rank - pos) - 1);
+        buffer->insertedSize--;
+        return;
+    }
+    if (pending && rank == pos + buffer->insertedSize) {        // "Delete" key right after the pending edit
+        buffer->deleted++;
+        return;
+    }
+    if (pending && rank + 1 == pos) {                           // "Backspace" right before the pending edit
+        buffer->pos--;
+        buffer->deleted++;
+        return;
+    }
+    editFlush(buffer);
+    buffer->pos = rank;
+    buffer->deleted = 1;
+}
+
+/* Returns the character at the given rank of the text (0 <= rank < editSize()). */
+static char editCharAt(EditBuffer *buffer, unsigned rank) {
+    if (rank >= buffer->pos) {
+        if (rank < buffer->pos + buffer->insertedSize)
+            return buffer->inserted[rank - buffer->pos];
+        rank = rank - buffer->insertedSize + buffer->deleted;
+    }
+    return orderStatisticZeroBasedRanking(buffer->tree, rank)->value;
+}
+
+/* *** Frozen rope *** */
+
+/* A read-only snapshot of a string, for phases with no edits. freeze() flattens the tree into chunks of characters,
+ * and thaw() builds a balanced tree from them again.
+ * A lookup is a binary search over the chunk offsets followed by a single memory access, and a substring is a few
+ * bulk copies; there's no splaying and no pointer chasing.
+ * The chunk boundaries are content-defined: a chunk ends after a character at which a rolling hash of the last
+ * 32 characters has its top FROZEN_BOUNDARY_BITS bits zero, as long as it's between FROZEN_MIN_CHUNK and
+ * FROZEN_MAX_CHUNK characters long. So the boundaries only depend on the nearby text, and identical regions of
+ * different strings (templates, boilerplate) are cut into identical chunks, even at different offsets.
+ * Chunks are immutable. They are interned in one process-wide table by their content hash and reference counted,
+ * so the memory of all frozen ropes together scales with their unique content, not with their total size.
+ * Chunks over small alphabets are bit-packed like the compressed segments (see _bitPack()), and the other chunks
+ * are stored as plain bytes.
+ * The table isn't synchronized, so frozen ropes must be created and destroyed by one thread at a time. */
+
+#define FROZEN_MIN_CHUNK 256
+#define FROZEN_MAX_CHUNK 4096
+#define FROZEN_BOUNDARY_BITS 10                                 // 1024 characters between boundaries on average, plus the minimum
+
+typedef struct FrozenChunk FrozenChunk;
+typedef struct FrozenRope FrozenRope;
+
+/* FrozenChunk "class" */
+struct FrozenChunk {
+    unsigned long long hash;                                    // FNV-1a hash of the characters
+    FrozenChunk *next;                                          // next chunk in the same bucket of the table
+    unsigned refs;                                              // number of references from frozen ropes
+    unsigned length;
+    unsigned bits;                                              // bits per character: 2, 5 or 8
+    char alphabet[32];                                          // code -> character, if packed
+    unsigned char data[];                                       // the characters, or their packed codes
+};
+
+/* FrozenRope "class" */
+struct FrozenRope {
+    FrozenChunk **chunks;
+    unsigned *starts;                                           // rank of the first character of every chunk, then the size
+    unsigned chunkCount;
+    unsigned size;
+};
+
+/* The process-wide table of interned chunks. */
+static FrozenChunk **frozenTable = NULL;
+static unsigned frozenBuckets = 0, frozenChunkCount = 0;
+static size_t frozenBytes = 0;                                  // memory held by the interned chunks
+
+/* Copies chunk characters [i..i+len-1] into out. */
+static void _chunkCopy(const FrozenChunk *chunk, unsigned i, unsigned len, char *out) {
+    if (chunk->bits == 8)
+        memcpy(out, chunk->data + i, len);
+    else
+        _bitUnpack(chunk->data, chunk->bits, chunk->alphabet, i, len, out);
+}
+
+/* Doubles the number of buckets of the chunk table. */
+static void _growFrozenTable(void) {
+    unsigned buckets = frozenBuckets ? 2 * frozenBuckets : 256;
+    FrozenChunk **table = calloc(buckets, sizeof(*table));
+    for (unsigned b = 0; b < frozenBuckets; b++)
+        while (frozenTable[b]) {
+            FrozenChunk *chunk = frozenTable[b];
+            frozenTable[b] = chunk->next;
+            chunk->next = table[chunk->hash & (buckets - 1)];
+            table[chunk->hash & (buckets - 1)] = chunk;
+        }
+    free(frozenTable);
+    frozenTable = table;
+    frozenBuckets = buckets;
+}
+
+/* Returns the interned chunk with the n characters of text, packing and adding it to the table if it isn't there yet.
+ * The caller gets one reference to it. */
+static FrozenChunk *_internChunk(const unsigned char *text, unsigned n) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    unsigned char codes[256];
+    char alphabet[32];
+    unsigned distinct;
+    for (unsigned i = 0; i < n; i++)
+        hash = (hash ^ text[i]) * 0x100000001B3ULL;
+    unsigned bits = _alphabetOf(text, n, codes, alphabet, &distinct);
+    size_t dataSize = bits == 8 ? n : _packedSize(n, bits);
+
+    if (frozenChunkCount >= frozenBuckets)
+        _growFrozenTable();
+    FrozenChunk **bucket = &frozenTable[hash & (frozenBuckets - 1)];
+    FrozenChunk *chunk = calloc(1, sizeof(FrozenChunk) + dataSize);
+    chunk->hash = hash;
+    chunk->refs = 1;
+    chunk->length = n;
+    chunk->bits = bits;
+    if (bits == 8)
+        memcpy(chunk->data, text, n);
+    else {
+        memcpy(chunk->alphabet, alphabet, distinct);
+        _bitPack(text, n, codes, bits, chunk->data);
+    }
+    for (FrozenChunk *other = *bucket; other; other = other->next)  // packing is deterministic, so equal texts have equal images
+        if (other->hash == hash && other->length == n && other->bits == bits &&
+            !memcmp(other->alphabet, chunk->alphabet, sizeof(chunk->alphabet)) && !memcmp(other->data, chunk->data, dataSize)) {
+            free(chunk);
+            other->refs++;
+            return other;
+        }
+    chunk->next = *bucket;
+    *bucket = chunk;
+    frozenChunkCount++;
+    frozenBytes += sizeof(FrozenChunk) + dataSize;
+    return chunk;
+}
+
+/* Drops one reference to the chunk, and frees it when it was the last one. */
+static void _releaseChunk(FrozenChunk *chunk) {
+    if (--chunk->refs)
+        return;
+    FrozenChunk **link = &frozenTable[chunk->hash & (frozenBuckets - 1)];
+    while (*link != chunk)
+        link = &(*link)->next;
+    *link = chunk->next;
+    frozenChunkCount--;
+    frozenBytes -= sizeof(FrozenChunk) + (chunk->bits == 8 ? chunk->length : _packedSize(chunk->length, chunk->bits));
+    free(chunk);
+    if (!frozenChunkCount) {                                    // the last frozen rope is gone
+        free(frozenTable);
+        frozenTable = NULL;
+        frozenBuckets = 0;
+    }
+}
+
+/* Returns the memory held by all the interned chunks, in bytes. */
+static size_t frozenMemory(void) {
+    return frozenBytes;
+}
+
+/* Converts the tree into a frozen rope. The tree is destroyed, together with its anchors and attributes. */
+static FrozenRope *freeze(SplayTree *tree) {
+    FrozenRope *frozen = malloc(sizeof(FrozenRope));
+    unsigned n = tree->size;
+    unsigned char *text = malloc(n + 1);
+    _touch(tree);
+    _inOrderInto(tree, (char *)text);
+    destroyTree(tree);
+    unsigned capacity = n / FROZEN_MIN_CHUNK + 1;
+    frozen->chunks = malloc(capacity * sizeof(*frozen->chunks));
+    frozen->starts = malloc((capacity + 1) * sizeof(*frozen->starts));
+    frozen->chunkCount = 0;
+    frozen->size = n;
+    unsigned start = 0, rolling = 0;
+    for (unsigned i = 0; i < n; i++) {
+        rolling = (rolling << 1) + (text[i] + 1) * 2654435761u;    // forgets characters older than 32 positions
+        unsigned length = i + 1 - start;
+        if (i + 1 == n || length == FROZEN_MAX_CHUNK ||
+            (length >= FROZEN_MIN_CHUNK && !(rolling >> (32 - FROZEN_BOUNDARY_BITS)))) {
+            frozen->starts[frozen->chunkCount] = start;
+            frozen->chunks[frozen->chunkCount++] = _internChunk(text + start, length);
+            start = i + 1;
+        }
+    }
+    frozen->starts[frozen->chunkCount] = n;
+    free(text);
+    return frozen;
+}
+
+/* Returns the index of the chunk which contains the character with the given rank. */
+static inline unsigned _findChunk(const FrozenRope *frozen, unsigned rank) {
+    unsigned lo = 0, hi = frozen->chunkCount - 1;               // invariant: starts[lo] <= rank < starts[hi + 1]
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo + 1) / 2;
+        if (frozen->starts[mid] <= rank)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Returns the character with the given rank (0 <= rank < size of the rope). */
+static inline char frozenCharAt(const FrozenRope *frozen, unsigned rank) {
+    unsigned c = _findChunk(frozen, rank);
+    const FrozenChunk *chunk = frozen->chunks[c];
+    rank -= frozen->starts[c];
+    if (chunk->bits == 8)
+        return (char)chunk->data[rank];
+    return chunk->alphabet[_bitCode(chunk->data, chunk->bits, rank)];
+}
+
+/* Copies S[i..i+len-1] into out (0 <= i <= i + len <= size of the rope). Doesn't add '\0'. */
+static void frozenSubstring(const FrozenRope *frozen, unsigned i, unsigned len, char *out) {
+    if (!len)
+        return;
+    for (unsigned c = _findChunk(frozen, i); len; c++) {
+        unsigned offset = i - frozen->starts[c];
+        unsigned count = frozen->chunks[c]->length - offset < len ? frozen->chunks[c]->length - offset : len;
+        _chunkCopy(frozen->chunks[c], offset, count, out);
+        out += count;
+        i += count;
+        len -= count;
+    }
+}
+
+/* "destructor" for the FrozenRope "class" */
+static void destroyFrozen(FrozenRope *frozen) {
+    if (!frozen)
+        return;
+    for (unsigned c = 0; c < frozen->chunkCount; c++)
+        _releaseChunk(frozen->chunks[c]);
+    free(frozen->chunks);
+    free(frozen->starts);
+    free(frozen);
+}
+
+/* Converts the frozen rope back into a balanced tree, which can be edited again. The frozen rope is destroyed. */
+static SplayTree *thaw(FrozenRope *frozen) {
+    RopeBuilder *builder = createBuilder();
+    char chunk[FROZEN_MAX_CHUNK];
+    for (unsigned c = 0; c < frozen->chunkCount; c++) {
+        _chunkCopy(frozen->chunks[c], 0, frozen->chunks[c]->length, chunk);
+        builderAppend(builder, chunk, frozen->chunks[c]->length);
+    }
+    destroyFrozen(frozen);
+    return builderFinish(builder);
+}
+
+/* *** Adaptive rope *** */
+
+/* AdaptiveRope keeps the string either in a plain array ("flat" backend) or in a splay tree, and switches
+ * between the two according to the observed workload.
+ * For every operation it estimates what it would have cost on both backends:
+ *     - process() on the flat backend moves all bytes between the cut and the paste position;
+ *       on the splay tree it takes six splits/merges, each about log(n) rotations;
+ *     - reading a character is a single load on the flat backend; on the splay tree it's proportional to
+ *       log(distance from the previously accessed rank), by the dynamic finger property of splay trees.
+ * The estimates are averaged exponentially. Every ADAPT_INTERVAL operations the rope switches to the other
+ * backend if it has been cheaper by a margin, and if the saving pays back the O(n) conversion within ADAPT_PAYBACK intervals.
+ * Costs are in units of one byte moved; the constants were measured on x86-64. */
+
+#define ADAPT_INTERVAL 1024
+#define ADAPT_PAYBACK 64
+#define ADAPT_ROTATION_COST 60.0                                // one rotation, in bytes moved
+#define ADAPT_CONVERSION_COST 250.0                             // converting one character between the backends
+#define ADAPT_HYSTERESIS 0.75                                   // switch only if the other backend costs less than this fraction
+#define ADAPT_DECAY 0.01                                        // weight of the newest operation in the averages
+
+typedef struct AdaptiveRope AdaptiveRope;
+
+/* AdaptiveRope "class" */
+struct AdaptiveRope {
+    SplayTree *tree;                                            // splay backend; NULL while the flat backend is active
+    char *flat;                                                 // flat backend; NULL while the splay backend is active
+    unsigned size;
+    double flatCost, treeCost;                                  // averaged estimated cost per operation
+    unsigned lastRank;                                          // rank of the previous access, for locality
+    unsigned ops;                                               // operations since the last decision
+};
+
+static inline double _log2(double x) {
+    double result = 0;
+    while (x >= 2) {
+        x /= 2;
+        result++;
+    }
+    return result + (x - 1);                                    // linear interpolation is good enough here
+}
+
+/* Reverses characters a[0..n-1] in place. */
+static inline void _reverse(char *a, unsigned n) {
+    for (unsigned i = 0, j = n - 1; n && i < j; i++, j--) {
+        char c = a[i];
+        a[i] = a[j];
+        a[j] = c;
+    }
+}
+
+/* Rotates a[0..n-1] to the left by shift positions, in place, with three reversals. */
+static void _rotateArray(char *a, unsigned n, unsigned shift) {
+    _reverse(a, shift);
+    _reverse(a + shift, n - shift);
+    _reverse(a, n);
+}
+
+/* The same as process(), on a plain array of n characters. */
+static void _processFlat(char *a, unsigned i, unsigned j, unsigned k) {
+    unsigned len = j - i + 1;
+    if (k < i)
+        _rotateArray(a + k, j - k + 1, i - k);
+    else if (k > i)
+        _rotateArray(a + i, k + len - i, len);
+}
+
+/* "constructor" for the AdaptiveRope "class"
+ * Input: string s of length n. Starts with the splay backend. */
+static AdaptiveRope *createAdaptiveRope(const char *s, unsigned n) {
+    AdaptiveRope *rope = malloc(sizeof(AdaptiveRope));
+    rope->tree = createTree();
+    rope->tree->root = _buildBalanced(s, n, NULL);
+    rope->tree->size = n;
+    rope->flat = NULL;
+    rope->size = n;
+    rope->flatCost = 0;
+    rope->treeCost = 0;
+    rope->lastRank = 0;
+    rope->ops = 0;
+    return rope;
+}
+
+/* "destructor" for the AdaptiveRope "class" */
+static void destroyAdaptiveRope(AdaptiveRope *rope) {
+    if (!rope)
+        return;
+    destroyTree(rope->tree);
+    free(rope->flat);
+    free(rope);
+}
+
+/* Accounts for one operation with the given estimated costs, and switches the backend when it's time to. */
+static void _adapt(AdaptiveRope *rope, double flatCost, double treeCost) {
+    rope->flatCost += ADAPT_DECAY * (flatCost - rope->flatCost);
+    rope->treeCost += ADAPT_DECAY * (treeCost - rope->treeCost);
+    if (++rope->ops < ADAPT_INTERVAL)
+        return;
+    rope->ops = 0;
+    double conversion = ADAPT_CONVERSION_COST * rope->size;
+    if (rope->tree && rope->flatCost < ADAPT_HYSTERESIS * rope->treeCost &&
+        (rope->treeCost - rope->flatCost) * ADAPT_INTERVAL * ADAPT_PAYBACK > conversion) {
+        rope->flat = malloc(rope->size + 1);
+        _touch(rope->tree);
+        _inOrderInto(rope->tree, rope->flat);
+        destroyTree(rope->tree);
+        rope->tree = NULL;
+    }
+    else if (rope->flat && rope->treeCost < ADAPT_HYSTERESIS * rope->flatCost &&
+             (rope->flatCost - rope->treeCost) * ADAPT_INTERVAL * ADAPT_PAYBACK > conversion) {
+        rope->tree = createTree();
+        rope->tree->root = _buildBalanced(rope->flat, rope->size, NULL);
+        rope->tree->size = rope->size;
+        free(rope->flat);
+        rope->flat = NULL;
+    }
+}
+
+/* The same as process(), on an adaptive rope. */
+static void adaptiveProcess(AdaptiveRope *rope, unsigned i, unsigned j, unsigned k) {
+    unsigned len = j - i + 1;
+    unsigned span = k < i ? j - k + 1 : (k > i ? k + len - i : 0);
+    double treeCost = 6 * ADAPT_ROTATION_COST * _log2(rope->size + 1.0);
+    if (rope->flat)
+        _processFlat(rope->flat, i, j, k);
+    else
+        process(&rope->tree, i, j, k);
+    rope->lastRank = k;
+    _adapt(rope, 2.0 * span, treeCost);                         // three reversals touch every byte twice
+}
+
+/* Returns the character at the given rank (0 <= rank < size of the rope). */
+static char adaptiveCharAt(AdaptiveRope *rope, unsigned rank) {
+    unsigned distance = rank > rope->lastRank ? rank - rope->lastRank : rope->lastRank - rank;
+    char c = rope->flat ? rope->flat[rank] : orderStatisticZeroBasedRanking(rope->tree, rank)->value;
+    rope->lastRank = rank;
+    _adapt(rope, 1.0, ADAPT_ROTATION_COST * (1 + _log2(distance + 1.0)));
+    return c;
+}
+
+/* Copies the string of the rope into result, which must have room for at least rope->size characters. */
+static void adaptiveToString(AdaptiveRope *rope, char *result) {
+    if (rope->flat)
+        memcpy(result, rope->flat, rope->size);
+    else {
+        _touch(rope->tree);
+        _inOrderInto(rope->tree, result);
+    }
+}
+
+/* *** Binary operation stream *** */
+
+/* The binary format carries the same data as the text format read by main(), but it's much faster to parse:
+ *     "ROPB" magic, n (varint), n bytes of the string, numOps (varint), numOps triples i, j, k (varints).
+ * Varints are little-endian base-128, as in the compressed trees. */
+
+#define BINARY_MAGIC "ROPB"
+
+/* Reads a varint from buf[*pos], without going past size.
+ * Returns FALSE if the buffer ends in the middle of the varint. */
+static inline int _readVarint(const unsigned char *buf, size_t size, size_t *pos, unsigned *x) {
+    unsigned shift = 0;
+    *x = 0;
+    while (*pos < size && shift < 35) {
+        unsigned char b = buf[(*pos)++];
+        *x |= (unsigned)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return TRUE;
+        shift += 7;
+    }
+    return FALSE;
+}
+
+/* Input: a buffer with an operation stream in the binary format.
+ * Builds the tree and applies all the operations to it with process().
+ * Returns the tree, or NULL if the stream is malformed or an operation violates the constraints. */
+static SplayTree *_replayBuffer(const unsigned char *buf, size_t size) {
+    size_t pos = sizeof(BINARY_MAGIC) - 1;
+    unsigned n, numOps;
+    if (size < pos || memcmp(buf, BINARY_MAGIC, pos) || !_readVarint(buf, size, &pos, &n) || size - pos < n)
+        return NULL;
+    RopeBuilder *builder = createBuilder();
+    builderAppend(builder, (const char *)buf + pos, n);
+    SplayTree *tree = builderFinish(builder);
+    pos += n;
+    if (!_readVarint(buf, size, &pos, &numOps)) {
+        destroyTree(tree);
+        return NULL;
+    }
+    for (unsigned op = 0; op < numOps; op++) {
+        unsigned i, j, k;
+        if (!_readVarint(buf, size, &pos, &i) || !_readVarint(buf, size, &pos, &j) || !_readVarint(buf, size, &pos, &k) ||
+            i > j || j >= n || k > n - (j - i + 1)) {
+            destroyTree(tree);
+            return NULL;
+        }
+        process(&tree, i, j, k);
+    }
+    return tree;
+}
+
+/* Replays the binary operation stream from the file at path.
+ * The file is memory-mapped where possible, so it's parsed in place, without copying.
+ * Returns the resulting tree, or NULL if the file can't be read or is malformed. */
+static SplayTree *replayBinary(const char *path) {
+    SplayTree *tree = NULL;
+#ifdef ROPE_POSIX
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *buf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return NULL;
+    madvise(buf, (size_t)st.st_size, MADV_SEQUENTIAL);
+    tree = _replayBuffer(buf, (size_t)st.st_size);
+    munmap(buf, (size_t)st.st_size);
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *buf = malloc(size > 0 ? size : 1);
+    if (size > 0 && fread(buf, 1, size, file) == (size_t)size)
+        tree = _replayBuffer(buf, size);
+    free(buf);
+    fclose(file);
+#endif // ROPE_POSIX
+    return tree;
+}
+
+/* Converts an operation stream from the text format (see main()) into the binary format.
+ * Input: the two files, opened in binary mode.
+ * Returns TRUE on success. */
+static int convertTextToBinary(FILE *in, FILE *out) {
+    static char rope[S_MAX_LEN];
+    unsigned char buf[15];
+    unsigned len = 0, numOps, n;
+    if (fscanf(in, "%300000s", rope) != 1 || fscanf(in, "%u", &numOps) != 1)
+        return FALSE;
+    n = strlen(rope);
+    _putVarint(buf, &len, n);
+    if (fwrite(BINARY_MAGIC, 1, sizeof(BINARY_MAGIC) - 1, out) != sizeof(BINARY_MAGIC) - 1 ||
+        fwrite(buf, 1, len, out) != len || fwrite(rope, 1, n, out) != n)
+        return FALSE;
+    len = 0;
+    _putVarint(buf, &len, numOps);
+    fwrite(buf, 1, len, out);
+    for (unsigned op = 0; op < numOps; op++) {
+        unsigned i, j, k;
+        if (fscanf(in, "%u%u%u", &i, &j, &k) != 3)
+            return FALSE;
+        len = 0;
+        _putVarint(buf, &len, i);
+        _putVarint(buf, &len, j);
+        _putVarint(buf, &len, k);
+        fwrite(buf, 1, len, out);
+    }
+    return !ferror(out);
+}
+
+#ifdef ROPE_SERVER
+
+/* *** Rope server *** */
+
+/* A long-running server that hosts named documents, so that jobs don't have to start a new process and rebuild
+ * the tree for every batch of operations. It listens on a Unix domain socket, and serves all clients from one
+ * epoll event loop. Requests are applied in the order in which they arrive, so the operations on every document
+ * are serialized without locks.
+ * Request:  op (1 byte), name length (1 byte), payload length (4 bytes), name, payload.
+ * Response: status (1 byte, 0 = OK), payload length (4 bytes), payload.
+ * Integers are little-endian 32-bit. */
+
+#define OP_LOAD 1                                               // payload: text; creates or replaces the document
+#define OP_PROCESS 2                                            // payload: i, j, k
+#define OP_INSERT 3                                             // payload: rank, text
+#define OP_SLICE 4                                              // payload: i, len; response: S[i..i+len-1]
+#define OP_STATS 5                                              // response: document size (0 if no such document), number of documents
+#define OP_DROP 6                                               // destroys the document
+#define OP_SHUTDOWN 7                                           // stops the server
+#define REQUEST_HEADER 6
+#define MAX_PAYLOAD (64u << 20)                                 // also the longest OP_SLICE
+#define CLIENT_INPUT_LIMIT (REQUEST_HEADER + 255 + MAX_PAYLOAD) // always room for one whole request
+#define CLIENT_OUTPUT_LIMIT (1u << 20)                          // no more requests are served while more output than this is unsent
+#define CLIENT_BUFFER 65536                                     // larger buffers are freed when they become empty
+#define DOCUMENT_BUCKETS 256
+
+typedef struct Document Document;
+
+/* Document "class": a named tree in the server's hash table. */
+struct Document {
+    char name[256];                                             // may contain '\0', so its length is kept apart
+    unsigned nameLen;
+    SplayTree *tree;
+    Document *next;
+};
+
+typedef struct Client Client;
+
+/* Client "class": a connection with its unparsed input and unsent output. */
+struct Client {
+    int fd;
+    unsigned char *in, *out;
+    size_t inSize, inCapacity, outSize, outCapacity, outSent;
+    Client *prev, *next;                                        // list of all connections
+};
+
+static inline unsigned _get32(const unsigned char *p) {
+    return p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+static inline void _put32(unsigned char *p, unsigned x) {
+    p[0] = (unsigned char)x;
+    p[1] = (unsigned char)(x >> 8);
+    p[2] = (unsigned char)(x >> 16);
+    p[3] = (unsigned char)(x >> 24);
+}
+
+/* Returns a pointer to the link that points to the named document, or to the NULL at the end of its bucket. */
+static Document **_findDocument(Document **table, const char *name, unsigned len) {
+    unsigned h = 5381;
+    for (unsigned i = 0; i < len; i++)
+        h = h * 33 + (unsigned char)name[i];
+    Document **link = &table[h % DOCUMENT_BUCKETS];
+    while (*link && ((*link)->nameLen != len || memcmp((*link)->name, name, len)))
+        link = &(*link)->next;
+    return link;
+}
+
+/* Makes room for len more bytes in a buffer. */
+static void _reserve(unsigned char **buf, size_t *capacity, size_t size, size_t len) {
+    if (size + len <= *capacity)
+        return;
+    while (size + len > *capacity)
+        *capacity = *capacity ? 2 * *capacity : 4096;
+    *buf = realloc(*buf, *capacity);
+}
+
+/* Queues a response. Returns a pointer to its payload, which the caller fills in. */
+static unsigned char *_respond(Client *client, int status, unsigned len) {
+    _reserve(&client->out, &client->outCapacity, client->outSize, 5 + (size_t)len);
+    unsigned char *p = client->out + client->outSize;
+    p[0] = (unsigned char)status;
+    _put32(p + 1, len);
+    client->outSize += 5 + (size_t)len;
+    return p + 5;
+}
+
+/* Applies one request to the documents, and queues the response.
+ * Returns FALSE if the server has to shut down. */
+static int _serveRequest(Document **table, Client *client, int op, const char *name, unsigned nameLen,
+                         const unsigned char *payload, unsigned len) {
+    Document **link = _findDocument(table, name, nameLen);
+    Document *document = *link;
+    SplayTree *tree = document ? document->tree : NULL;
+    unsigned i, j, k;
+    switch (op) {
+    case OP_LOAD: {
+        RopeBuilder *builder = createBuilder();
+        builderAppend(builder, (const char *)payload, len);
+        if (!document) {
+            document = calloc(1, sizeof(Document));
+            memcpy(document->name, name, nameLen);
+            document->nameLen = nameLen;
+            *link = document;
+        }
+        destroyTree(document->tree);
+        document->tree = builderFinish(builder);
+        _respond(client, 0, 0);
+        return TRUE;
+    }
+    case OP_PROCESS:
+        if (!tree || len != 12)
+            break;
+        i = _get32(payload), j = _get32(payload + 4), k = _get32(payload + 8);
+        if (i > j || j >= tree->size || k > tree->size - (j - i + 1))
+            break;
+        process(&document->tree, i, j, k);
+        _respond(client, 0, 0);
+        return TRUE;
+    case OP_INSERT:
+        if (!tree || len < 4 || _get32(payload) > tree->size)
+            break;
+        splice(tree, _get32(payload), 0, (const char *)payload + 4, len - 4);
+        _respond(client, 0, 0);
+        return TRUE;
+    case OP_SLICE:
+        if (!tree || len != 8)
+            break;
+        i = _get32(payload), j = _get32(payload + 4);
+        if (i > tree->size || j > tree->size - i || j > MAX_PAYLOAD)
+            break;
+        substring(tree, i, j, (char *)_respond(client, 0, j));
+        return TRUE;
+    case OP_STATS: {
+        unsigned count = 0;
+        for (unsigned b = 0; b < DOCUMENT_BUCKETS; b++)
+            for (Document *d = table[b]; d; d = d->next)
+                count++;
+        unsigned char *p = _respond(client, 0, 8);
+        _put32(p, tree ? tree->size : 0);
+        _put32(p + 4, count);
+        return TRUE;
+    }
+    case OP_DROP:
+        if (!document)
+            break;
+        *link = document->next;
+        destroyTree(document->tree);
+        free(document);
+        _respond(client, 0, 0);
+        return TRUE;
+    case OP_SHUTDOWN:
+        _respond(client, 0, 0);
+        return FALSE;
+    }
+    _respond(client, 1, 0);
+    return TRUE;
+}
+
+/* Sends as much of the queued output as the socket takes.
+ * Returns FALSE if the connection is broken. */
+static int _flushClient(Client *client) {
+    while (client->outSent < client->outSize) {
+        ssize_t sent = send(client->fd, client->out + client->outSent, client->outSize - client->outSent, MSG_NOSIGNAL);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        client->outSent += (size_t)sent;
+    }
+    client->outSize = 0;
+    client->outSent = 0;
+    if (client->outCapacity > CLIENT_BUFFER) {                  // e.g. after a long slice
+        free(client->out);
+        client->out = NULL;
+        client->outCapacity = 0;
+    }
+    return TRUE;
+}
+
+static void _closeClient(int epoll, Client **clients, Client *client) {
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        *clients = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    epoll_ctl(epoll, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client->in);
+    free(client->out);
+    free(client);
+}
+
+/* Reads what is available from the client, but never more than CLIENT_INPUT_LIMIT bytes of unparsed input;
+ * the rest stays in the socket until the buffered requests are served.
+ * Returns FALSE if the connection has to be closed. */
+static int _readClient(Client *client) {
+    while (client->inSize < CLIENT_INPUT_LIMIT) {
+        size_t room = CLIENT_INPUT_LIMIT - client->inSize;
+        _reserve(&client->in, &client->inCapacity, client->inSize, room < CLIENT_BUFFER ? room : CLIENT_BUFFER);
+        room = client->inCapacity - client->inSize;
+        if (room > CLIENT_INPUT_LIMIT - client->inSize)
+            room = CLIENT_INPUT_LIMIT - client->inSize;
+        ssize_t got = recv(client->fd, client->in + client->inSize, room, 0);
+        if (got == 0)
+            return FALSE;
+        if (got < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        client->inSize += (size_t)got;
+    }
+    return TRUE;
+}
+
+/* Serves the complete requests in the client's input, as long as its unsent output stays under CLIENT_OUTPUT_LIMIT,
+ * so a client that doesn't read its responses can't make the server queue them without bound.
+ * Returns FALSE if the connection has to be closed; sets *running to FALSE on OP_SHUTDOWN. */
+static int _serveClient(Document **table, Client *client, int *running) {
+    size_t pos = 0;
+    while (*running && client->inSize - pos >= REQUEST_HEADER && client->outSize - client->outSent < CLIENT_OUTPUT_LIMIT) {
+        const unsigned char *header = client->in + pos;
+        unsigned nameLen = header[1], len = _get32(header + 2);
+        if (len > MAX_PAYLOAD)
+            return FALSE;
+        if (client->inSize - pos < REQUEST_HEADER + (size_t)nameLen + len)
+            break;
+        const char *name = (const char *)header + REQUEST_HEADER;
+        *running = _serveRequest(table, client, header[0], name, nameLen, header + REQUEST_HEADER + nameLen, len);
+        pos += REQUEST_HEADER + (size_t)nameLen + len;
+    }
+    if (pos) {                                                  // client->in is NULL if it was freed and nothing came since
+        memmove(client->in, client->in + pos, client->inSize - pos);
+        client->inSize -= pos;
+    }
+    if (!client->inSize && client->inCapacity > CLIENT_BUFFER) {   // e.g. after a long OP_LOAD
+        free(client->in);
+        client->in = NULL;
+        client->inCapacity = 0;
+    }
+    return TRUE;
+}
+
+/* Runs the server on the Unix domain socket at path, until a client sends OP_SHUTDOWN.
+ * Returns 0 on a clean shutdown, and -1 if the socket can't be set up. */
+static int serve(const char *path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+        return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    struct stat st;
+    if (!lstat(path, &st)) {                                    // a stale socket of a previous run; anything else is left alone
+        if (!S_ISSOCK(st.st_mode)) {
+            close(listener);
+            return -1;
+        }
+        unlink(path);
+    }
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, SOMAXCONN) ||
+        epoll < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event)) {
+        close(listener);
+        if (epoll >= 0)
+            close(epoll);
+        return -1;
+    }
+    Document *table[DOCUMENT_BUCKETS] = { NULL };
+    Client *clients = NULL;
+    struct epoll_event events[64];
+    int running = TRUE;
+    while (running) {
+        int count = epoll_wait(epoll, events, 64, -1);
+        if (count < 0 && errno != EINTR)
+            break;
+        for (int e = 0; e < count && running; e++) {
+            Client *client = events[e].data.ptr;
+            if (!client) {                                      // the listener
+                int fd;
+                while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    client = calloc(1, sizeof(Client));
+                    client->fd = fd;
+                    client->next = clients;
+                    if (clients)
+                        clients->prev = client;
+                    clients = client;
+                    event.events = EPOLLIN;
+                    event.data.ptr = client;
+                    epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+                }
+                continue;
+            }
+            if (((events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !_readClient(client)) ||
+                !_serveClient(table, client, &running) || !_flushClient(client)) {
+                _closeClient(epoll, &clients, client);
+                continue;
+            }
+            if (client->outSize - client->outSent < CLIENT_OUTPUT_LIMIT && running && !_serveClient(table, client, &running)) {
+                _closeClient(epoll, &clients, client);          // the flush made room for more responses
+                continue;
+            }
+            event.events = 0;                                   // input is only read while it can be served
+            if (client->inSize < CLIENT_INPUT_LIMIT && client->outSize - client->outSent < CLIENT_OUTPUT_LIMIT)
+                event.events |= EPOLLIN;
+            if (client->outSize)
+                event.events |= EPOLLOUT;
+            event.data.ptr = client;
+            epoll_ctl(epoll, EPOLL_CTL_MOD, client->fd, &event);
+        }
+    }
+    while (clients) {
+        _flushClient(clients);                                  // e.g. the acknowledgement of OP_SHUTDOWN, if it fits
+        _closeClient(epoll, &clients, clients);
+    }
+    for (unsigned b = 0; b < DOCUMENT_BUCKETS; b++)
+        while (table[b]) {
+            Document *next = table[b]->next;
+            destroyTree(table[b]->tree);
+            free(table[b]);
+            table[b] = next;
+        }
+    close(epoll);
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+#endif // ROPE_SERVER
+
+/* *** Self-check *** */
+
+/* "rope -t [seed]" runs randomized checks of the API. Every check applies the same random operations to a rope and
+ * to a flat string, which is edited the naive way, and compares the two as it goes. The first difference is reported
+ * with the name of the check and the step, and stops the program. */
+
+#define CHECK_STEPS 2000
+#define CHECK_FILE "rope-self-check.tmp"                        // scratch file in the current directory
+
+/* Stops the self-check if ok is FALSE. */
+static void _expect(int ok, const char *check, unsigned step) {
+    if (ok)
         return;
+    printf("Self-check of %s failed at step %u\n", check, step);
+    exit(-1);
+}
+
+/* Fills text with n random characters from the first "letters" lowercase letters, in runs of 1 to 4 characters. */
+static void _randomText(char *text, unsigned n, unsigned letters) {
+    unsigned i = 0;
+    while (i < n) {
+        char value = (char)('a' + rand() % letters);
+        for (unsigned run = 1 + rand() % 4; run && i < n; run--)
+            text[i++] = value;
     }
+}
 
-    /* Inserting in the middle (or at the beginning). */
-    if (tree->size == 0) {
-        /* The tree is empty. */
-        tree->size++;                                                   // Tree size
-        tree->root = node;
+/* Picks random valid arguments of process() for a string of length n > 0. */
+static void _randomProcess(unsigned n, unsigned *i, unsigned *j, unsigned *k) {
+    *i = rand() % n;
+    *j = *i + rand() % (n - *i);
+    *k = rand() % (n - (*j - *i + 1) + 1);
+}
+
+/* Applies process() to the flat string text of length n. */
+static void _flatProcess(char *text, unsigned n, unsigned i, unsigned j, unsigned k) {
+    unsigned m = j - i + 1;
+    char *cut = malloc(m);
+    memcpy(cut, text + i, m);
+    memmove(text + i, text + j + 1, n - j - 1);
+    memmove(text + k + m, text + k, n - m - k);
+    memcpy(text + k, cut, m);
+    free(cut);
+}
+
+static SplayTree *_treeOf(const char *text, unsigned n) {
+    RopeBuilder *builder = createBuilder();
+    builderAppend(builder, text, n);
+    return builderFinish(builder);
+}
+
+/* Returns TRUE if the tree holds exactly the n characters of text. */
+static int _sameText(SplayTree *tree, const char *text, unsigned n) {
+    if (tree->size != n)
+        return FALSE;
+    char *result = malloc(n + 1);
+    _touch(tree);
+    _inOrderInto(tree, result);
+    int same = !memcmp(result, text, n);
+    free(result);
+    return same;
+}
+
+/* Returns TRUE if the file at path holds exactly the n characters of text. */
+static int _sameFile(const char *path, const char *text, unsigned n) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return FALSE;
+    char *contents = malloc(n + 1);
+    int same = fread(contents, 1, n + 1, file) == n && !memcmp(contents, text, n);
+    fclose(file);
+    free(contents);
+    return same;
+}
+
+/* compressIfCold(): edits and reads of a tree whose segments get packed again and again. */
+static void _checkCompression(void) {
+    unsigned n = 3 * SEGMENT_SIZE;
+    char *text = malloc(n);
+    _randomText(text, n, 4);
+    SplayTree *tree = _treeOf(text, n);
+    advanceEpoch();
+    _expect(!compressIfCold(tree, 2), "compressIfCold", 0);     // still warm
+    advanceEpoch();
+    _expect(compressIfCold(tree, 2) && _sameText(tree, text, n), "compressIfCold", 0);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k, rank = rand() % n;
+        _randomProcess(n, &i, &j, &k);
+        process(&tree, i, j, k);
+        _flatProcess(text, n, i, j, k);
+        _expect(orderStatisticZeroBasedRanking(tree, rank)->value == text[rank], "compressIfCold", step);
+        if (step % 50)
+            continue;
+        advanceEpoch();
+        compressIfCold(tree, 1);
+        _expect(_sameText(tree, text, n), "compressIfCold", step);
+    }
+    destroyTree(tree);
+    free(text);
+    _expect(!segmentCount, "compressIfCold", CHECK_STEPS);      // destroyTree() freed all the segments
+}
+
+/* openPageFile(): edits of several compressed trees while only two of their segments are kept in memory. */
+static void _checkPaging(void) {
+    enum { TREES = 3 };
+    unsigned n = 4 * SEGMENT_SIZE;
+    SplayTree *trees[TREES];
+    char *texts[TREES];
+    for (unsigned t = 0; t < TREES; t++) {
+        texts[t] = malloc(n);
+        _randomText(texts[t], n, 4);
+        trees[t] = _treeOf(texts[t], n);
+        compressIfCold(trees[t], 0);
+    }
+    _expect(openPageFile(CHECK_FILE, 2) && !openPageFile(CHECK_FILE, 2), "openPageFile", 0);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned t = rand() % TREES, i, j, k, rank = rand() % n;
+        _randomProcess(n, &i, &j, &k);
+        process(&trees[t], i, j, k);
+        _flatProcess(texts[t], n, i, j, k);
+        _expect(orderStatisticZeroBasedRanking(trees[t], rank)->value == texts[t][rank], "openPageFile", step);
+        if (step % 50)
+            continue;
+        compressIfCold(trees[rand() % TREES], 0);
+        _expect(_sameText(trees[t], texts[t], n) && pageResident <= 2, "openPageFile", step);
+    }
+    closePageFile();
+    remove(CHECK_FILE);
+    for (unsigned t = 0; t < TREES; t++) {
+        _expect(_sameText(trees[t], texts[t], n), "closePageFile", CHECK_STEPS);
+        destroyTree(trees[t]);
+        free(texts[t]);
+    }
+}
+
+/* checkpointAsync(): checkpoints copied in random slices between edits, which must hold the text as it was
+ * when the copy was completed. */
+static void _checkCheckpoints(void) {
+    unsigned n = 5000;
+    char *text = malloc(n + 5), *snapshot = malloc(n);
+    _randomText(text, n, 26);
+    SplayTree *tree = _treeOf(text, n);
+    Checkpoint *checkpoint = checkpointAsync(tree, CHECK_FILE);
+    int complete = FALSE;
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k;
+        _randomProcess(n, &i, &j, &k);
+        process(&tree, i, j, k);
+        _flatProcess(text, n, i, j, k);
+        if (!complete && checkpointStep(checkpoint, 1 + rand() % 500)) {
+            memcpy(snapshot, text, n);
+            complete = TRUE;
+        }
+        if (step % 100)
+            continue;
+        if (!complete)
+            memcpy(snapshot, text, n);                          // checkpointWait() completes the copy right away
+        _expect(checkpointWait(checkpoint) && _sameFile(CHECK_FILE, snapshot, n), "checkpointAsync", step);
+        checkpoint = checkpointAsync(tree, CHECK_FILE);
+        complete = FALSE;
+    }
+    checkpointWait(checkpoint);
+    checkpoint = checkpointAsync(tree, CHECK_FILE);             // an applyEdits() behind the part that is copied
+    checkpointStep(checkpoint, 600);
+    Edit edit = { 10, 5, "applyEdits", 10 };
+    applyEdits(tree, &edit, 1);
+    memmove(text + 20, text + 15, n - 15);
+    memcpy(text + 10, "applyEdits", 10);
+    while (!checkpointStep(checkpoint, 600))
+        ;
+    _expect(checkpointWait(checkpoint) && _sameFile(CHECK_FILE, text, n + 5), "applyEdits", CHECK_STEPS);
+    remove(CHECK_FILE);
+    destroyTree(tree);
+    free(text);
+    free(snapshot);
+}
+
+/* convertTextToBinary() and replayBinary(): a random operation stream in the text format, converted and replayed,
+ * and then the same stream cut short, and a stream with an operation out of range, which must both be rejected. */
+static void _checkBinaryStream(void) {
+    unsigned n = 3000;
+    char *text = malloc(n + 1);
+    _randomText(text, n, 26);
+    text[n] = '\0';
+    FILE *in = tmpfile(), *out = fopen(CHECK_FILE, "wb");
+    _expect(in && out, "convertTextToBinary", 0);
+    fprintf(in, "%s\n%u\n", text, CHECK_STEPS);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k;
+        _randomProcess(n, &i, &j, &k);
+        fprintf(in, "%u %u %u\n", i, j, k);
+        _flatProcess(text, n, i, j, k);
+    }
+    rewind(in);
+    _expect(convertTextToBinary(in, out), "convertTextToBinary", CHECK_STEPS);
+    fclose(in);
+    fclose(out);
+    SplayTree *tree = replayBinary(CHECK_FILE);
+    _expect(tree && _sameText(tree, text, n), "replayBinary", CHECK_STEPS);
+    destroyTree(tree);
+    in = fopen(CHECK_FILE, "rb");                               // cut off the last byte
+    unsigned char *stream = malloc(2 * n + 15 * CHECK_STEPS);
+    size_t size = fread(stream, 1, 2 * n + 15 * CHECK_STEPS, in);
+    fclose(in);
+    out = fopen(CHECK_FILE, "wb");
+    fwrite(stream, 1, size - 1, out);
+    fclose(out);
+    _expect(!replayBinary(CHECK_FILE), "replayBinary", CHECK_STEPS);
+    in = tmpfile();                                             // j == n
+    out = fopen(CHECK_FILE, "wb");
+    fprintf(in, "abc\n1\n1 3 0\n");
+    rewind(in);
+    _expect(convertTextToBinary(in, out), "convertTextToBinary", CHECK_STEPS);
+    fclose(in);
+    fclose(out);
+    _expect(!replayBinary(CHECK_FILE), "replayBinary", CHECK_STEPS);
+    remove(CHECK_FILE);
+    free(stream);
+    free(text);
+}
+
+/* createAdaptiveRope(): alternating phases of edits and of reads, which must switch the rope between its backends. */
+static void _checkAdaptiveRope(void) {
+    unsigned n = 60000;
+    char *text = malloc(n), *result = malloc(n);
+    _randomText(text, n, 26);
+    AdaptiveRope *rope = createAdaptiveRope(text, n);
+    int usedFlat = FALSE, usedTree = FALSE;
+    for (unsigned step = 1; step <= 4 * CHECK_STEPS; step++) {
+        unsigned i, j, k, rank = rand() % n;
+        if (step / CHECK_STEPS % 2 == 0) {                      // an editing phase
+            _randomProcess(n, &i, &j, &k);
+            adaptiveProcess(rope, i, j, k);
+            _flatProcess(text, n, i, j, k);
+        }
+        _expect(adaptiveCharAt(rope, rank) == text[rank], "createAdaptiveRope", step);
+        usedFlat = usedFlat || rope->flat;
+        usedTree = usedTree || rope->tree;
+        if (step % CHECK_STEPS)
+            continue;
+        adaptiveToString(rope, result);
+        _expect(!memcmp(result, text, n), "adaptiveToString", step);
+    }
+    _expect(usedFlat && usedTree, "createAdaptiveRope", 4 * CHECK_STEPS);
+    destroyAdaptiveRope(rope);
+    free(text);
+    free(result);
+}
+
+/* orderStatisticMany(): sorted batches of ranks, with duplicates, in a tree that is edited and sometimes compressed. */
+static void _checkBatchedRanks(void) {
+    enum { BATCH = 64 };
+    unsigned n = 2 * SEGMENT_SIZE, ranks[BATCH];
+    char *text = malloc(n), result[BATCH];
+    _randomText(text, n, 4);
+    SplayTree *tree = _treeOf(text, n);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k, count = 1 + rand() % BATCH;
+        _randomProcess(n, &i, &j, &k);
+        process(&tree, i, j, k);
+        _flatProcess(text, n, i, j, k);
+        if (step % 100 == 0)
+            compressIfCold(tree, 0);
+        ranks[0] = rand() % n;
+        for (unsigned r = 1; r < count; r++) {                  // sorted, with small gaps and some duplicates
+            ranks[r] = ranks[r - 1] + rand() % 3;
+            if (ranks[r] >= n)
+                ranks[r] = n - 1;
+        }
+        orderStatisticMany(tree, ranks, count, result);
+        for (unsigned r = 0; r < count; r++)
+            _expect(result[r] == text[ranks[r]], "orderStatisticMany", step);
+    }
+    destroyTree(tree);
+    free(text);
+}
+
+/* createWindow(): random appends and prefix drops, with the window held between a few and about 20000 characters. */
+static void _checkWindow(void) {
+    unsigned capacity = 20000 + 2 * WINDOW_TAIL_CAPACITY, n = 0;
+    char *text = malloc(capacity);
+    LogWindow *window = createWindow();
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned len = rand() % (2 * WINDOW_TAIL_CAPACITY);
+        _randomText(text + n, len, 26);
+        windowAppend(window, text + n, len);
+        n += len;
+        if (n > 20000 || rand() % 2) {
+            unsigned drop = n > 20000 ? n - 20000 + rand() % 20001 : rand() % (n + 1);
+            windowDropPrefix(window, drop);
+            memmove(text, text + drop, n - drop);
+            n -= drop;
+        }
+        for (unsigned read = 0; n && read < 10; read++) {
+            unsigned rank = rand() % n;
+            _expect(windowCharAt(window, rank) == text[rank], "createWindow", step);
+        }
+    }
+    windowDropPrefix(window, n);
+    n = WINDOW_TAIL_CAPACITY + 10;                              // a full tree and a short tail, then drop all of the tree
+    _randomText(text, 2 * n, 26);
+    windowAppend(window, text, n);
+    Anchor *anchor = createAnchor(window->tree, 100);
+    windowDropPrefix(window, WINDOW_TAIL_CAPACITY);
+    windowAppend(window, text + n, n);
+    _expect(anchorPosition(window->tree, anchor) == 0 && windowCharAt(window, 0) == text[WINDOW_TAIL_CAPACITY],
+            "windowDropPrefix", CHECK_STEPS);
+    destroyWindow(window);
+    free(text);
+}
+
+/* swapRanges(): random swaps, a quarter of them of adjacent ranges, with anchors on the edges of the ranges and
+ * at the end of the string, which must follow their characters. */
+static void _checkSwapRanges(void) {
+    enum { ANCHORS = 7 };
+    unsigned n = 3000;
+    char *text = malloc(n), *swapped = malloc(n);
+    _randomText(text, n, 26);
+    SplayTree *tree = _treeOf(text, n);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i1 = rand() % (n - 1), j1 = i1 + rand() % (n - 1 - i1), i2, j2;
+        i2 = rand() % 4 ? j1 + 1 + rand() % (n - 1 - j1) : j1 + 1;
+        j2 = rand() % 4 ? i2 + rand() % (n - i2) : n - 1;
+        unsigned len1 = j1 - i1 + 1, middle = i2 - j1 - 1, len2 = j2 - i2 + 1;
+        unsigned ranks[ANCHORS] = { i1, j1, j1 + 1, i2 - 1, i2, j2, n }, expected[ANCHORS];
+        Anchor *anchors[ANCHORS];
+        for (unsigned a = 0; a < ANCHORS; a++) {
+            unsigned rank = ranks[a];
+            anchors[a] = createAnchor(tree, rank);
+            if (rank < i1 || rank > j2)
+                expected[a] = rank;
+            else if (rank <= j1)
+                expected[a] = rank + len2 + middle;
+            else if (rank < i2)
+                expected[a] = rank - len1 + len2;
+            else
+                expected[a] = rank - middle - len1;
+        }
+        swapRanges(&tree, i1, j1, i2, j2);
+        memcpy(swapped, text, i1);
+        memcpy(swapped + i1, text + i2, len2);
+        memcpy(swapped + i1 + len2, text + j1 + 1, middle);
+        memcpy(swapped + i1 + len2 + middle, text + i1, len1);
+        memcpy(swapped + j2 + 1, text + j2 + 1, n - j2 - 1);
+        memcpy(text, swapped, n);
+        for (unsigned a = 0; a < ANCHORS; a++) {
+            _expect(anchorPosition(tree, anchors[a]) == expected[a], "swapRanges", step);
+            destroyAnchor(tree, anchors[a]);
+        }
+        if (step % 100 == 0)
+            _expect(_sameText(tree, text, n), "swapRanges", step);
+    }
+    _expect(_sameText(tree, text, n), "swapRanges", CHECK_STEPS);
+    destroyTree(tree);
+    free(text);
+    free(swapped);
+}
+
+/* longestCommonPrefix() and compareRanges(): on a text which repeats a block, so that the common prefixes are long. */
+static void _checkRangeComparisons(void) {
+    unsigned n = 5000;
+    char *text = malloc(n);
+    _randomText(text, 500, 2);
+    for (unsigned i = 500; i < n; i++)
+        text[i] = text[i - 500];
+    SplayTree *tree = _treeOf(text, n);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k, p1 = rand() % (n + 1), p2 = rand() % (n + 1), lcp = 0;
+        _randomProcess(n, &i, &j, &k);
+        process(&tree, i, j, k);
+        _flatProcess(text, n, i, j, k);
+        while (p1 + lcp < n && p2 + lcp < n && text[p1 + lcp] == text[p2 + lcp])
+            lcp++;
+        _expect(longestCommonPrefix(tree, p1, p2) == lcp, "longestCommonPrefix", step);
+        unsigned i1 = rand() % n, j1 = i1 + rand() % (n - i1), i2 = rand() % n, j2 = i2 + rand() % (n - i2);
+        unsigned len1 = j1 - i1 + 1, len2 = j2 - i2 + 1;
+        int expected = memcmp(text + i1, text + i2, len1 < len2 ? len1 : len2);
+        if (!expected)
+            expected = (len1 > len2) - (len1 < len2);
+        int result = compareRanges(tree, i1, j1, i2, j2);
+        _expect((result > 0) - (result < 0) == (expected > 0) - (expected < 0), "compareRanges", step);
+    }
+    destroyTree(tree);
+    free(text);
+}
+
+/* createEditBuffer(): typing at a cursor that mostly moves by one and sometimes jumps, on a tree built with
+ * insertSpecific(); between the typing sessions, the tree is edited directly with insert(). */
+static void _checkEditBuffer(void) {
+    unsigned capacity = 1000 + 2 * CHECK_STEPS, n = 1000, cursor = 0;
+    char *text = malloc(capacity);
+    _randomText(text, n, 26);
+    SplayTree *tree = createTree();
+    for (unsigned i = 0; i < n; i++)
+        insertSpecific(tree, text[i]);
+    EditBuffer *buffer = createEditBuffer(tree);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        int action = rand() % 10;
+        char value = (char)('a' + rand() % 26);
+        if (action == 0)                                        // a click somewhere else
+            cursor = rand() % (n + 1);
+        else if (action < 6 || !n) {                            // typing
+            editInsert(buffer, cursor, value);
+            memmove(text + cursor + 1, text + cursor, n - cursor);
+            text[cursor++] = value;
+            n++;
+        }
+        else if (action < 8 && cursor) {                        // Backspace
+            editDelete(buffer, --cursor);
+            memmove(text + cursor, text + cursor + 1, --n - cursor);
+        }
+        else if (cursor < n) {                                  // Delete
+            editDelete(buffer, cursor);
+            memmove(text + cursor, text + cursor + 1, --n - cursor);
+        }
+        _expect(editSize(buffer) == n, "createEditBuffer", step);
+        for (unsigned read = 0; n && read < 5; read++) {
+            unsigned rank = rand() % n;
+            _expect(editCharAt(buffer, rank) == text[rank], "editCharAt", step);
+        }
+        if (step % 100)
+            continue;
+        destroyEditBuffer(buffer);
+        _expect(_sameText(tree, text, n), "destroyEditBuffer", step);
+        unsigned rank = rand() % (n + 1);
+        insert(tree, rank, value);
+        memmove(text + rank + 1, text + rank, n - rank);
+        text[rank] = value;
+        n++;
+        _expect(_sameText(tree, text, n), "insert", step);
+        buffer = createEditBuffer(tree);
+    }
+    destroyEditBuffer(buffer);
+    _expect(_sameText(tree, text, n), "destroyEditBuffer", CHECK_STEPS);
+    destroyTree(tree);
+    free(text);
+}
+
+/* applyEdits(), splice() and erase(): batches of sorted multi-cursor edits, and single ones, which change the size. */
+static void _checkMultiEdits(void) {
+    enum { EDITS = 16 };
+    unsigned capacity = 3000 + EDITS * 8, n = 1000;
+    char *text = malloc(capacity), inserted[EDITS][8];
+    Edit edits[EDITS];
+    _randomText(text, n, 26);
+    SplayTree *tree = _treeOf(text, n);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned count = 0, next = 0;
+        while (count < EDITS && next <= n && rand() % 8) {
+            Edit *edit = &edits[count];
+            edit->pos = next + rand() % ((n - next) / 4 + 1);
+            edit->count = rand() % ((n - edit->pos) / 8 + 1);
+            edit->len = n > 2000 ? 0 : rand() % 8;              // the text grows up to about 2000 characters
+            _randomText(inserted[count], edit->len, 26);
+            edit->text = inserted[count++];
+            next = edit->pos + edit->count + 1;                 // the next edit can't touch this one
+        }
+        applyEdits(tree, edits, count);
+        for (unsigned e = count; e-- > 0;) {                    // from right to left, so that the ranks stay valid
+            Edit *edit = &edits[e];
+            memmove(text + edit->pos + edit->len, text + edit->pos + edit->count, n - edit->pos - edit->count);
+            memcpy(text + edit->pos, edit->text, edit->len);
+            n = n - edit->count + edit->len;
+        }
+        _expect(_sameText(tree, text, n), "applyEdits", step);
+        unsigned i = rand() % (n + 1), erased = rand() % ((n - i) / 8 + 1), len = rand() % 8;
+        _randomText(inserted[0], len, 26);
+        splice(tree, i, erased, inserted[0], len);
+        memmove(text + i + len, text + i + erased, n - i - erased);
+        memcpy(text + i, inserted[0], len);
+        n = n - erased + len;
+        if (n > 1) {
+            i = rand() % (n - 1);
+            unsigned j = i + rand() % ((n - i) / 8 + 1);
+            if (j >= n - 1)
+                j = n - 2;                                      // never erases the whole text
+            erase(tree, i, j);
+            memmove(text + i, text + j + 1, n - j - 1);
+            n -= j - i + 1;
+        }
+        _expect(_sameText(tree, text, n), "splice", step);
+    }
+    destroyTree(tree);
+    free(text);
+}
+
+/* createAnchor(): anchors through process(), splice(), split() and merge(). The reference gives every character an id,
+ * and an anchor follows the id of its character; when the character is deleted, the anchor moves to the character
+ * after the deleted range, or to the end of the string (id -1). */
+static void _checkAnchors(void) {
+    enum { ANCHORS = 12 };
+    unsigned capacity = 1000, n = 500, nextId = 0, targets[ANCHORS];
+    char *text = malloc(capacity);
+    unsigned *ids = malloc(capacity * sizeof(*ids)), *moved = malloc(capacity * sizeof(*ids));
+    Anchor *anchors[ANCHORS];
+    _randomText(text, n, 26);
+    for (; nextId < n; nextId++)
+        ids[nextId] = nextId;
+    SplayTree *tree = _treeOf(text, n);
+    for (unsigned a = 0; a < ANCHORS; a++) {
+        unsigned rank = rand() % (n + 1);
+        anchors[a] = createAnchor(tree, rank);
+        targets[a] = rank < n ? ids[rank] : (unsigned)-1;
+    }
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k, action = rand() % 4;
+        if (action == 0) {
+            _randomProcess(n, &i, &j, &k);
+            process(&tree, i, j, k);
+            _flatProcess(text, n, i, j, k);
+            unsigned m = j - i + 1;                             // the same move on the ids
+            memcpy(moved, ids + i, m * sizeof(*ids));
+            memmove(ids + i, ids + j + 1, (n - j - 1) * sizeof(*ids));
+            memmove(ids + k + m, ids + k, (n - m - k) * sizeof(*ids));
+            memcpy(ids + k, moved, m * sizeof(*ids));
+        }
+        else if (action == 1 && n > 1) {
+            SplayTree *left, *right;
+            split(tree, rand() % (n - 1), &left, &right);
+            destroyTree(tree);
+            tree = _join(left, right);
+        }
+        else if (action == 2) {
+            unsigned a = rand() % ANCHORS, rank = rand() % (n + 1);
+            destroyAnchor(tree, anchors[a]);
+            anchors[a] = createAnchor(tree, rank);
+            targets[a] = rank < n ? ids[rank] : (unsigned)-1;
+        }
+        else {
+            unsigned len = n > 800 ? 0 : rand() % 8, erased;
+            i = rand() % (n + 1);
+            erased = rand() % ((n - i) / 4 + 1);
+            if (erased == n)
+                erased--;
+            char inserted[8];
+            _randomText(inserted, len, 26);
+            splice(tree, i, erased, inserted, len);
+            unsigned next = i + erased < n ? ids[i + erased] : (unsigned)-1;
+            for (unsigned a = 0; a < ANCHORS; a++)
+                for (unsigned x = i; x < i + erased; x++)
+                    if (ids[x] == targets[a])
+                        targets[a] = next;
+            memmove(text + i + len, text + i + erased, n - i - erased);
+            memcpy(text + i, inserted, len);
+            memmove(ids + i + len, ids + i + erased, (n - i - erased) * sizeof(*ids));
+            for (unsigned x = 0; x < len; x++)
+                ids[i + x] = nextId++;
+            n = n - erased + len;
+        }
+        for (unsigned a = 0; a < ANCHORS; a++) {
+            unsigned expected = n;
+            for (unsigned x = 0; x < n && targets[a] != (unsigned)-1; x++)
+                if (ids[x] == targets[a])
+                    expected = x;
+            _expect(anchorPosition(tree, anchors[a]) == expected, "createAnchor", step);
+        }
+    }
+    _expect(_sameText(tree, text, n), "createAnchor", CHECK_STEPS);
+    destroyAnchor(tree, anchors[0]);
+    destroyTree(tree);                                          // with the other anchors
+    free(text);
+    free(ids);
+    free(moved);
+}
+
+/* A copy of the text that is kept up to date only from the edit events, for _checkObserver(). The new text of a
+ * replacement isn't known to the observer, so it's marked with '\0' and filled in from the reference afterwards. */
+typedef struct {
+    char *text;
+    unsigned size;
+} Mirror;
+
+static void _mirrorEdit(void *context, const EditEvent *event) {
+    Mirror *mirror = context;
+    char *text = mirror->text;
+    unsigned rest = mirror->size - event->oldStart - event->oldLength;
+    if (event->kind == EDIT_MOVE) {
+        char *moved = malloc(event->oldLength + 1);
+        memcpy(moved, text + event->oldStart, event->oldLength);
+        memmove(text + event->oldStart, text + event->oldStart + event->oldLength, rest);
+        memmove(text + event->newStart + event->newLength, text + event->newStart, mirror->size - event->oldLength - event->newStart);
+        memcpy(text + event->newStart, moved, event->newLength);
+        free(moved);
         return;
     }
-    Node *right = orderStatisticZeroBasedRanking(tree, rank);           // This will be right node of the newly inserted node.
-    node->right = right;
-    node->left = right->left;
-    right->parent = node;
-    right->left = NULL;
-    right->size = (right->right ? right->right->size : 0) + 1;
-    node->size = (node->left ? node->left->size : 0) + (node->right ? node->right->size : 0) + 1;
-    tree->size++;                                                       // Tree size
-    tree->root = node;
+    memmove(text + event->newStart + event->newLength, text + event->oldStart + event->oldLength, rest);
+    memset(text + event->newStart, 0, event->newLength);
+    mirror->size = mirror->size - event->oldLength + event->newLength;
 }
 
-/* Input: value is a lowercase English letter.
- * This is a specific method, that doesn't work in general case of a splay tree.
- * Namely, we first insert entire string and then perform operations on it.
- * We will never insert a new character in the string again.
- * Adds a node with letter "value" to the tree, as the new root of the tree.
- * Returns nothing. */
-static void insertSpecific(SplayTree *tree, char value) {
-    Node *node = createNode(value);
-    if (tree->root)
-        tree->root->parent = node;
-    node->left = tree->root;
-    node->size = (node->left ? node->left->size : 0) + 1;
-    tree->root = node;
-    tree->size++;
+/* setObserver(): a mirror of the text, replayed from the events of process(), rotate(), insert(), splice() and applyEdits(). */
+static void _checkObserver(void) {
+    unsigned capacity = 2000, n = 500;
+    char *text = malloc(capacity);
+    Mirror mirror = { malloc(capacity), n };
+    _randomText(text, n, 26);
+    memcpy(mirror.text, text, n);
+    SplayTree *tree = _treeOf(text, n);
+    setObserver(tree, _mirrorEdit, &mirror);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k, action = rand() % 5, len = n > 1000 ? 0 : rand() % 8, erased;
+        char inserted[8];
+        _randomText(inserted, 8, 26);
+        i = rand() % (n + 1);
+        erased = rand() % ((n - i) / 4 + 1);
+        if (erased == n)
+            erased--;
+        if (action == 0) {
+            _randomProcess(n, &i, &j, &k);
+            process(&tree, i, j, k);
+            _flatProcess(text, n, i, j, k);
+        }
+        else if (action == 1) {
+            unsigned shift = rand() % n;
+            rotate(&tree, shift);
+            _flatProcess(text, n, 0, shift ? shift - 1 : 0, shift ? n - shift : 0);
+        }
+        else if (action == 2) {
+            insert(tree, i, inserted[0]);
+            memmove(text + i + 1, text + i, n++ - i);
+            text[i] = inserted[0];
+        }
+        else {
+            if (action == 3)
+                splice(tree, i, erased, inserted, len);
+            else {
+                Edit edit = { i, erased, inserted, len };
+                applyEdits(tree, &edit, 1);
+            }
+            memmove(text + i + len, text + i + erased, n - i - erased);
+            memcpy(text + i, inserted, len);
+            n = n - erased + len;
+        }
+        _expect(mirror.size == n, "setObserver", step);
+        for (unsigned x = 0; x < n; x++)
+            if (!mirror.text[x])
+                mirror.text[x] = text[x];
+        _expect(!memcmp(mirror.text, text, n), "setObserver", step);
+    }
+    setObserver(tree, NULL, NULL);
+    process(&tree, 0, 0, n - 1);                                // not observed any more
+    _expect(mirror.size == n && !memcmp(mirror.text, text, n), "setObserver", CHECK_STEPS);
+    destroyTree(tree);
+    free(text);
+    free(mirror.text);
 }
 
-/* Input: pointer to a tree; pointer to a Node object in the tree.
- * Returns a pointer to a node object with maximum key value in the subtree rooted at node.
- * Splays the found node to the top of the tree. */
-static Node *subtreeMaximum(SplayTree *tree, Node *node) {
-    if (!node)
-        return NULL;
-    while (node->right)
-        node = node->right;
-    _splay(tree, node);
-    return node;
+#ifdef ROPE_SERVER
+
+/* Writes a request into frame, which has room for it. Returns its length. */
+static unsigned _frameRequest(unsigned char *frame, int op, const char *name, unsigned nameLen, const void *payload,
+                              unsigned len) {
+    frame[0] = (unsigned char)op;
+    frame[1] = (unsigned char)nameLen;
+    _put32(frame + 2, len);
+    memcpy(frame + REQUEST_HEADER, name, nameLen);
+    if (len)
+        memcpy(frame + REQUEST_HEADER + nameLen, payload, len);
+    return REQUEST_HEADER + nameLen + len;
 }
 
+/* Sends a request to the server end of the socket pair. */
+static void _sendRequest(int fd, int op, const char *name, unsigned nameLen, const void *payload, unsigned len) {
+    unsigned char *frame = malloc(REQUEST_HEADER + nameLen + len);
+    send(fd, frame, _frameRequest(frame, op, name, nameLen, payload, len), 0);
+    free(frame);
+}
 
+/* Lets the server read and serve its input, and flush the responses. */
+static void _serveOnce(Document **table, Client *client) {
+    int running = TRUE;
+    _expect(_readClient(client) && _serveClient(table, client, &running) && _flushClient(client) && running, "serve", 0);
+}
 
-/* Merges two Splay trees, tree1 and tree2, using the last element (of highest rank) in tree1 (left string) as the node for merging, into a new Splay tree.
- * CONSTRAINTS: None.
- * INPUT: pointers to tree1 and tree2.
- * OUTPUT (the return value of this function) is pointer to tree1, with all the elements of both trees.
- * USAGE: After this function, we can delete tree2. */
-static SplayTree *merge(SplayTree *tree1, SplayTree *tree2) {
-    if (!tree1 || !tree1->root)
-        return tree2;
-    if (!tree2 || !tree2->root)
-        return tree1;
-    Node *root2 = tree2->root;
-    Node *root1 = subtreeMaximum(tree1, tree1->root);
-    root2->parent = root1;
-    root1->right = root2;
-    root1->size = (root1->left ? root1->left->size : 0) + (root1->right ? root1->right->size : 0) + 1;
-    tree1->size = root1->size;
-    return tree1;
+/* Receives a response. Returns its status, and its payload in buf (of at least len bytes), if it's len bytes long;
+ * any other length counts as a failure (status -1). */
+static int _receiveResponse(int fd, char *buf, unsigned len) {
+    unsigned char header[5];
+    if (recv(fd, header, 5, MSG_WAITALL) != 5 || _get32(header + 1) != len)
+        return -1;
+    if (len && recv(fd, buf, len, MSG_WAITALL) != (ssize_t)len)
+        return -1;
+    return header[0];
 }
 
-/*  Splits Splay tree into two trees.
- * Input: pointer to a Splay tree; rank of a node (counting starts from 0; 0 <= rank < size of the whole tree);
- *     two pointers to SplayTree pointers, by which the new Splay trees are returned (in-out).
- * Output: Two Splay trees, one with elements with rank <= "rank", the other with elements with rank > "rank",
- *     fetched by the last two arguments to the function.
- * There is no return value. */
-static void split(SplayTree *tree, unsigned rank, SplayTree **tree1, SplayTree **tree2) {
-    Node *root1 = orderStatisticZeroBasedRanking(tree, rank);
-    Node *root2 = root1->right;
-    root1->right = NULL;
-    root1->size = (root1->left ? root1->left->size : 0) + (root1->right ? root1->right->size : 0) + 1;
-    *tree1 = createTree();
-    (*tree1)->root = root1;                                     // insertTree()
-    (*tree1)->size = root1->size;
-    *tree2 = createTree();
-    if (root2) {
-        root2->parent = NULL;
-        (*tree2)->root = root2;                                 // insertTree()
-        (*tree2)->size = root2->size;
+/* The server's request handling over a socket pair, without the event loop: OP_LOAD, then batches of pipelined
+ * OP_INSERT, OP_PROCESS and OP_SLICE requests, with a request split between two reads, and documents whose names
+ * contain '\0', which must not be confused with each other, and which OP_DROP must free. */
+static void _checkServer(void) {
+    unsigned n = 2000, capacity = n + 8 * CHECK_STEPS;
+    char *text = malloc(capacity), *slice = malloc(capacity);
+    unsigned char payload[12 + 8], frame[REQUEST_HEADER + 3 + 8];
+    unsigned from = 0, len = 0;
+    int fds[2];
+    _expect(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "serve", 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    Client *client = calloc(1, sizeof(Client));
+    client->fd = fds[0];
+    Document *table[DOCUMENT_BUCKETS] = { NULL };
+    _randomText(text, n, 26);
+    _sendRequest(fds[1], OP_LOAD, "doc", 3, text, n);
+    _serveOnce(table, client);
+    _expect(_receiveResponse(fds[1], NULL, 0) == 0, "OP_LOAD", 0);
+    char *big = calloc(CLIENT_BUFFER, 1);                       // the input buffer grows, and is freed when it's empty
+    _sendRequest(fds[1], OP_LOAD, "big", 3, big, CLIENT_BUFFER);
+    _sendRequest(fds[1], OP_DROP, "big", 3, NULL, 0);
+    _serveOnce(table, client);
+    int running = TRUE;
+    _expect(!client->in && _serveClient(table, client, &running), "serve", 0);
+    _expect(_receiveResponse(fds[1], NULL, 0) == 0 && _receiveResponse(fds[1], NULL, 0) == 0, "OP_LOAD", 0);
+    free(big);
+    for (unsigned step = 1; step <= CHECK_STEPS; step += 4) {
+        unsigned i, j, k, rank = rand() % (n + 1);
+        len = rand() % 8;
+        _put32(payload, rank);                                  // four pipelined requests
+        _randomText((char *)payload + 4, len, 26);
+        _sendRequest(fds[1], OP_INSERT, "doc", 3, payload, 4 + len);
+        memmove(text + rank + len, text + rank, n - rank);
+        memcpy(text + rank, payload + 4, len);
+        n += len;
+        _randomProcess(n, &i, &j, &k);
+        _put32(payload, i);
+        _put32(payload + 4, j);
+        _put32(payload + 8, k);
+        _sendRequest(fds[1], OP_PROCESS, "doc", 3, payload, 12);
+        _flatProcess(text, n, i, j, k);
+        _put32(payload, 0);
+        _put32(payload + 4, n);                                 // one past the end
+        _sendRequest(fds[1], OP_PROCESS, "doc", 3, payload, 12);
+        from = rand() % (n + 1);
+        len = rand() % (n - from + 1);
+        _put32(payload, from);
+        _put32(payload + 4, len);
+        _sendRequest(fds[1], OP_SLICE, "doc", 3, payload, 8);
+        _serveOnce(table, client);
+        _expect(_receiveResponse(fds[1], NULL, 0) == 0, "OP_INSERT", step);
+        _expect(_receiveResponse(fds[1], NULL, 0) == 0, "OP_PROCESS", step + 1);
+        _expect(_receiveResponse(fds[1], NULL, 0) == 1, "OP_PROCESS", step + 2);
+        _expect(_receiveResponse(fds[1], slice, len) == 0 && !memcmp(slice, text + from, len), "OP_SLICE", step + 3);
     }
-    return;
+    unsigned size = _frameRequest(frame, OP_SLICE, "doc", 3, payload, 8);
+    send(fds[1], frame, 4, 0);                                  // a part of the header comes in one read, the rest in the next
+    _serveOnce(table, client);
+    _expect(client->inSize == 4 && recv(fds[1], slice, 1, MSG_DONTWAIT) < 0, "serve", CHECK_STEPS);
+    send(fds[1], frame + 4, size - 4, 0);
+    _serveOnce(table, client);
+    _expect(_receiveResponse(fds[1], slice, len) == 0 && !memcmp(slice, text + from, len), "OP_SLICE", CHECK_STEPS);
+    const char *names[3] = { "a\0b", "a\0c", "a" };
+    unsigned nameLens[3] = { 3, 3, 1 };
+    for (unsigned repeat = 0; repeat < 3; repeat++)
+        for (unsigned d = 0; d < 3; d++)
+            _sendRequest(fds[1], OP_LOAD, names[d], nameLens[d], text, d + 1);
+    _sendRequest(fds[1], OP_STATS, names[1], nameLens[1], NULL, 0);
+    for (unsigned d = 0; d < 3; d++)
+        _sendRequest(fds[1], OP_DROP, names[d], nameLens[d], NULL, 0);
+    _sendRequest(fds[1], OP_DROP, "doc", 3, NULL, 0);
+    _sendRequest(fds[1], OP_DROP, "doc", 3, NULL, 0);
+    _sendRequest(fds[1], OP_STATS, "doc", 3, NULL, 0);
+    _serveOnce(table, client);
+    for (unsigned r = 0; r < 9; r++)
+        _expect(_receiveResponse(fds[1], NULL, 0) == 0, "OP_LOAD", CHECK_STEPS);
+    _expect(_receiveResponse(fds[1], slice, 8) == 0 && _get32((unsigned char *)slice) == 2 &&
+            _get32((unsigned char *)slice + 4) == 4, "OP_STATS", CHECK_STEPS);
+    for (unsigned r = 0; r < 4; r++)
+        _expect(_receiveResponse(fds[1], NULL, 0) == 0, "OP_DROP", CHECK_STEPS);
+    _expect(_receiveResponse(fds[1], NULL, 0) == 1, "OP_DROP", CHECK_STEPS);
+    _expect(_receiveResponse(fds[1], slice, 8) == 0 && _get32((unsigned char *)slice + 4) == 0, "OP_STATS", CHECK_STEPS);
+    for (unsigned b = 0; b < DOCUMENT_BUCKETS; b++)
+        _expect(!table[b], "OP_DROP", CHECK_STEPS);
+    close(fds[0]);
+    close(fds[1]);
+    free(client->in);
+    free(client->out);
+    free(client);
+    free(text);
+    free(slice);
 }
 
-/* This is cut-and-paste function.
- * For i and j, counting starts from 0; for k, counting starts from 1.
- * We paste the substring after the k - th symbol of the remaining string(after cutting).
- * If k == 0, we insert the substring at the beginning. */
-/* We can't destroy left, middle and right at the end of the function,
- * because merge() doesn't create a new tree.
- * Function merge() returns a pointer to a tree, which means that its two parts
- * are preserved. It just merges them together.
- * Globally, we don't change the size of the tree in this function.
- * We just split it and then merge it back.
- * That's why total memory consumption is fine. */
-void process(SplayTree **tree, unsigned i, unsigned j, unsigned k) {
-    /* If these three pointers are declared static, it's very slow. */
-    SplayTree *left = NULL, *middle = NULL, *right = NULL;
-    split(*tree, j, &middle, &right);
-    if (i > 0)
-        split(middle, i - 1, &left, &middle);
-    left = merge(left, right);
-    if (k > 0)
-        split(left, k - 1, &left, &right);
-    else {
-        right = left;
-        left = NULL;
+#endif // ROPE_SERVER
+
+/* freeze() and thaw(): reads from frozen ropes over alphabets of 4, 16 and 64 characters, between rounds of edits. */
+static void _checkFrozenRope(void) {
+    unsigned n = 20000;
+    char *text = malloc(n), *result = malloc(n);
+    for (unsigned letters = 4; letters <= 64; letters *= 4) {   // packed in 2 bits, in 5 bits, and not packed
+        for (unsigned i = 0; i < n; i++)
+            text[i] = (char)(' ' + rand() % letters);
+        SplayTree *tree = _treeOf(text, n);
+        for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+            unsigned i, j, k;
+            _randomProcess(n, &i, &j, &k);
+            process(&tree, i, j, k);
+            _flatProcess(text, n, i, j, k);
+            if (step % 200)
+                continue;
+            FrozenRope *frozen = freeze(tree);
+            for (unsigned read = 0; read < 100; read++) {
+                unsigned rank = rand() % n, len = rand() % (n - rank + 1);
+                _expect(frozenCharAt(frozen, rank) == text[rank], "frozenCharAt", step);
+                frozenSubstring(frozen, rank, len, result);
+                _expect(!memcmp(result, text + rank, len), "frozenSubstring", step);
+            }
+            tree = thaw(frozen);
+            _expect(_sameText(tree, text, n), "thaw", step);
+        }
+        destroyTree(tree);
     }
-    *tree = merge(merge(left, middle), right);
-    return;
+    free(text);
+    free(result);
+}
+
+/* frozenMemory(): identical frozen ropes share all their chunks, and one small edit only adds the chunks around it. */
+static void _checkChunkSharing(void) {
+    unsigned n = 50000;
+    char *text = malloc(n), *result = malloc(n);
+    _randomText(text, n, 26);
+    FrozenRope *first = freeze(_treeOf(text, n));
+    size_t memory = frozenMemory();
+    FrozenRope *second = freeze(_treeOf(text, n));
+    _expect(frozenMemory() == memory, "frozenMemory", 0);
+    text[n / 2] = text[n / 2] == 'a' ? 'b' : 'a';
+    FrozenRope *third = freeze(_treeOf(text, n));
+    _expect(frozenMemory() > memory && frozenMemory() < memory + 4 * FROZEN_MAX_CHUNK, "frozenMemory", 1);
+    frozenSubstring(third, 0, n, result);
+    _expect(!memcmp(result, text, n), "frozenMemory", 1);
+    destroyTree(thaw(first));
+    destroyTree(thaw(second));
+    destroyTree(thaw(third));
+    _expect(!frozenMemory(), "frozenMemory", 2);
+    free(text);
+    free(result);
+}
+
+/* nodeMemory() and setNodeRetention(): the slabs of a destroyed tree are kept up to the retention, and no more. */
+static void _checkNodeMemory(void) {
+    unsigned n = 200000;
+    char *text = malloc(n);
+    _randomText(text, n, 26);
+    setNodeRetention(0);
+    size_t memory = nodeMemory();                               // the slabs of the nodes that are still alive
+    for (unsigned retention = 0; retention <= 8; retention += 4) {
+        setNodeRetention(retention);
+        SplayTree *tree = _treeOf(text, n);
+        for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+            unsigned i, j, k;
+            _randomProcess(n, &i, &j, &k);
+            process(&tree, i, j, k);
+        }
+        _expect(nodeMemory() >= memory + (size_t)tree->size / 4 * sizeof(Node), "nodeMemory", retention);
+        destroyTree(tree);
+        _expect(nodeMemory() == memory + retention * NODE_SLAB_SIZE, "setNodeRetention", retention);
+    }
+    setNodeRetention(0);
+    _expect(nodeMemory() == memory, "setNodeRetention", 0);
+    setNodeRetention(NODE_RETENTION);
+    free(text);
+}
+
+/* The spans reported by visitSpans(), for _checkAttributes(). */
+typedef struct {
+    unsigned *attributes;                                       // of the visited range, filled in span by span
+    unsigned start, end;                                        // the visited range so far
+    unsigned spans;
+    int ok;                                                     // boolean; FALSE if a span didn't follow the previous one
+} SpanLog;
+
+static void _logSpan(void *context, unsigned start, unsigned length, unsigned attribute) {
+    SpanLog *log = context;
+    log->ok = log->ok && start == log->end && length;
+    for (unsigned x = start; x < start + length && log->ok; x++)
+        log->attributes[x - log->start] = attribute;
+    log->end = start + length;
+    log->spans++;
+}
+
+/* setAttribute(), attributeAt() and visitSpans(): attributes that move with their characters through process(). */
+static void _checkAttributes(void) {
+    unsigned n = 3000;
+    char *text = malloc(n);
+    unsigned *attributes = calloc(n, sizeof(*attributes)), *moved = malloc(n * sizeof(*moved));
+    SpanLog log = { malloc(n * sizeof(*log.attributes)), 0, 0, 0, TRUE };
+    _randomText(text, n, 26);
+    SplayTree *tree = _treeOf(text, n);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i = rand() % n, j = i + rand() % ((n - i) / 8 + 1), k, attribute = rand() % 4;
+        setAttribute(tree, i, j, attribute);
+        for (unsigned x = i; x <= j; x++)
+            attributes[x] = attribute;
+        _randomProcess(n, &i, &j, &k);
+        process(&tree, i, j, k);
+        _flatProcess(text, n, i, j, k);
+        unsigned m = j - i + 1;                                 // the same move on the attributes
+        memcpy(moved, attributes + i, m * sizeof(*moved));
+        memmove(attributes + i, attributes + j + 1, (n - j - 1) * sizeof(*moved));
+        memmove(attributes + k + m, attributes + k, (n - m - k) * sizeof(*moved));
+        memcpy(attributes + k, moved, m * sizeof(*moved));
+        unsigned rank = rand() % n;
+        _expect(attributeAt(tree, rank) == attributes[rank], "attributeAt", step);
+        unsigned len = rand() % (n - rank + 1), spans = len > 0;
+        for (unsigned x = rank + 1; x < rank + len; x++)
+            spans += attributes[x] != attributes[x - 1];
+        log.start = log.end = rank;
+        log.spans = 0;
+        visitSpans(tree, rank, len, _logSpan, &log);
+        _expect(log.ok && log.spans == spans && log.end == rank + len, "visitSpans", step);
+        _expect(!memcmp(log.attributes, attributes + rank, len * sizeof(*moved)), "visitSpans", step);
+    }
+    _expect(_sameText(tree, text, n), "setAttribute", CHECK_STEPS);
+    destroyTree(tree);
+    free(text);
+    free(attributes);
+    free(moved);
+    free(log.attributes);
+}
+
+/* replaceAll(): short patterns over two letters, so that the matches overlap and fail in the middle of runs,
+ * in a tree that is sometimes compressed. */
+static void _checkReplaceAll(void) {
+    unsigned capacity = 10 * SEGMENT_SIZE, n = 0;               // a one-letter pattern replaced with five letters
+    char *text = malloc(capacity), *result = malloc(capacity);
+    SplayTree *tree = NULL;
+    for (unsigned step = 1; step <= CHECK_STEPS / 4; step++) {
+        if (n < SEGMENT_SIZE || n > 2 * SEGMENT_SIZE) {         // starts over when the text shrinks or grows too much
+            destroyTree(tree);
+            n = SEGMENT_SIZE + rand() % SEGMENT_SIZE;
+            _randomText(text, n, 2);
+            tree = _treeOf(text, n);
+        }
+        char pattern[6], replacement[6];
+        unsigned m = rand() % 6, len = rand() % 6, size = 0, x = 0;
+        _randomText(pattern, m, 2);
+        _randomText(replacement, len, 3);
+        if (step % 10 == 0)
+            compressIfCold(tree, 0);
+        while (x < n) {                                         // from left to right, without overlaps
+            if (m && x + m <= n && !memcmp(text + x, pattern, m)) {
+                memcpy(result + size, replacement, len);
+                size += len;
+                x += m;
+            }
+            else
+                result[size++] = text[x++];
+        }
+        SplayTree *replaced = replaceAll(tree, pattern, m, replacement, len);
+        _expect(_sameText(tree, text, n) && _sameText(replaced, result, size), "replaceAll", step);
+        destroyTree(tree);
+        tree = replaced;
+        memcpy(text, result, size);
+        n = size;
+    }
+    destroyTree(tree);
+    free(text);
+    free(result);
+}
+
+#ifdef ROPE_LAYOUT
+
+/* Returns the column after the character c, if it starts at the given column, with the default layout. */
+static unsigned _flatAdvance(unsigned column, char c) {
+    return c == '\t' ? (column / TAB_WIDTH + 1) * TAB_WIDTH : column + 1;
+}
+
+/* columnOf() and offsetAtColumn(): on a text of letters, tabs and newlines, between edits. */
+static void _checkLayout(void) {
+    unsigned n = 3000;
+    char *text = malloc(n);
+    const char characters[] = "abc\t\t\n";
+    for (unsigned i = 0; i < n; i++)
+        text[i] = characters[rand() % (sizeof(characters) - 1)];
+    SplayTree *tree = _treeOf(text, n);
+    for (unsigned step = 1; step <= CHECK_STEPS; step++) {
+        unsigned i, j, k, rank = rand() % (n + 1), column = 0, start = rank, line = rand() % 600;
+        _randomProcess(n, &i, &j, &k);
+        process(&tree, i, j, k);
+        _flatProcess(text, n, i, j, k);
+        while (start && text[start - 1] != '\n')
+            start--;
+        for (unsigned x = start; x < rank; x++)
+            column = _flatAdvance(column, text[x]);
+        _expect(columnOf(tree, rank) == column, "columnOf", step);
+        column = rand() % 40;
+        unsigned newlines = 0;
+        for (start = 0; newlines < line && start < n; start++)  // the start of the line, or n if there's no such line
+            newlines += text[start] == '\n';
+        for (unsigned c = 0; start < n && text[start] != '\n' && _flatAdvance(c, text[start]) <= column; start++)
+            c = _flatAdvance(c, text[start]);
+        _expect(offsetAtColumn(tree, line, column) == start, "offsetAtColumn", step);
+    }
+    destroyTree(tree);
+    free(text);
 }
 
+#endif // ROPE_LAYOUT
+
+/* Runs all the checks with the given seed. Returns 0, because a failed check stops the program. */
+static int selfCheck(unsigned seed) {
+    srand(seed);
+    _checkCompression();
+    _checkPaging();
+    _checkCheckpoints();
+    _checkBinaryStream();
+    _checkAdaptiveRope();
+    _checkBatchedRanks();
+    _checkWindow();
+    _checkSwapRanges();
+    _checkRangeComparisons();
+    _checkEditBuffer();
+    _checkMultiEdits();
+    _checkAnchors();
+    _checkObserver();
+#ifdef ROPE_SERVER
+    _checkServer();
+#endif // ROPE_SERVER
+    _checkFrozenRope();
+    _checkChunkSharing();
+    _checkNodeMemory();
+    _checkAttributes();
+    _checkReplaceAll();
+#ifdef ROPE_LAYOUT
+    _checkLayout();
+#endif // ROPE_LAYOUT
+    printf("Self-check passed\n");
+    return 0;
+}
 
 /*
  * Example usage:
@@ -479,17 +5087,54 @@ void process(SplayTree **tree, unsigned i, unsigned j, unsigned k) {
  * 0 <= i <= j <= n - 1
  * 0 <= k <= n - (j - i + 1)
  * We can't use blanks.
+ *
+ * rope -c text_file binary_file    converts the text input format into the binary format;
+ * rope -b binary_file              replays a binary operation stream, and prints the resulting string;
+ * rope -s socket_path              runs the rope server (on Linux);
+ * rope -t [seed]                   runs the randomized self-check of the API.
  */
 
-int main() {
+int main(int argc, char *argv[]) {
+    if (argc == 4 && !strcmp(argv[1], "-c")) {
+        FILE *in = fopen(argv[2], "rb"), *out = fopen(argv[3], "wb");
+        int ok = in && out && convertTextToBinary(in, out);
+        if (in)
+            fclose(in);
+        if (out)
+            ok = !fclose(out) && ok;
+        if (!ok)
+            printf("Conversion failed\n");
+        return ok ? 0 : -1;
+    }
+    if (argc == 3 && !strcmp(argv[1], "-b")) {
+        SplayTree *tree = replayBinary(argv[2]);
+        if (!tree) {
+            printf("Can't replay %s\n", argv[2]);
+            return -1;
+        }
+        char *result = malloc(tree->size + 1);
+        _touch(tree);
+        _inOrderInto(tree, result);
+        fwrite(result, 1, tree->size, stdout);
+        free(result);
+        destroyTree(tree);
+        return 0;
+    }
+    if ((argc == 2 || argc == 3) && !strcmp(argv[1], "-t"))
+        return selfCheck(argc == 3 ? (unsigned)strtoul(argv[2], NULL, 10) : 1);
+#ifdef ROPE_SERVER
+    if (argc == 3 && !strcmp(argv[1], "-s"))
+        return serve(argv[2]);
+#endif // ROPE_SERVER
+
+
     static char rope[S_MAX_LEN];
     unsigned numOps, n;
     scanf("%s", &rope);
     n = strlen(rope);
-    SplayTree *tree = createTree();
-    for (size_t i = 0; i < n; i++)
-        //insert(tree, i, rope[i]);
-        insertSpecific(tree, rope[i]);
+    RopeBuilder *builder = createBuilder();
+    builderAppend(builder, rope, n);
+    SplayTree *tree = builderFinish(builder);
     scanf("%u", &numOps);
     for (unsigned i = 0; i < numOps; i++) {
         unsigned i, j, k;